@@ -3,8 +3,9 @@
 
 #include <cstddef>
 
-inline int sample_size = 64;
-inline int text_embedding_size = 768;
-inline int output_size = 512;
+// Defaults for GenerationContext; every job carries its own values.
+inline constexpr int default_output_size = 512;
+inline constexpr int default_text_embedding_size = 768;
+inline constexpr float default_nsfw_threshold = 0.5f;
 
-#endif  // CONFIG_HPP
\ No newline at end of file
+#endif  // CONFIG_HPP
@@ -1,4 +1,5 @@
 // self-implemented DPMSolverMultistepScheduler class
+#include <algorithm>
 #include <cmath>
 #include <optional>
 #include <string>
@@ -10,12 +11,12 @@
 #include <xtensor/xmath.hpp>
 #include <xtensor/xrandom.hpp>
 #include <xtensor/xview.hpp>
+#include <xsimd/xsimd.hpp>
 
-class DPMSolverMultistepScheduler {
+#include "Scheduler.hpp"
+
+class DPMSolverMultistepScheduler : public Scheduler {
  public:
-  struct SchedulerOutput {
-    xt::xarray<float> prev_sample;
-  };
 
   DPMSolverMultistepScheduler(int num_train_timesteps, float beta_start,
                               float beta_end, const std::string &beta_schedule,
@@ -48,16 +49,12 @@ class DPMSolverMultistepScheduler {
     lambda_t_ = xt::log(alpha_t_) - xt::log(sigma_t_);
     sigmas_ = xt::pow((1.0f - alphas_cumprod_) / alphas_cumprod_, 0.5f);
 
-    model_outputs_.resize(solver_order_);
-    std::fill(model_outputs_.begin(), model_outputs_.end(),
-              xt::xarray<float>());
-
     lower_order_nums_ = 0;
     step_index_ = std::nullopt;
     begin_index_ = std::nullopt;
   }
 
-  void set_timesteps(int num_inference_steps) {
+  void set_timesteps(int num_inference_steps) override {
     num_inference_steps_ = num_inference_steps;
 
     if (timestep_spacing_ == "leading") {
@@ -77,10 +74,7 @@ class DPMSolverMultistepScheduler {
     sigmas_ = xt::concatenate(
         std::make_tuple(selected_sigmas, xt::zeros<float>({1})));
 
-    model_outputs_.clear();
-    model_outputs_.resize(solver_order_);
-    std::fill(model_outputs_.begin(), model_outputs_.end(),
-              xt::xarray<float>());
+    precompute_coefficients();
 
     lower_order_nums_ = 0;
     step_index_ = std::nullopt;
@@ -95,128 +89,49 @@ class DPMSolverMultistepScheduler {
 
   void set_prediction_type(const std::string &prediction_type) {
     prediction_type_ = prediction_type;
-  }
-
-  xt::xarray<float> convert_model_output(const xt::xarray<float> &model_output,
-                                         const xt::xarray<float> &sample) {
-    float sigma = sigmas_(step_index_.value());
-    auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigma);
-    if (prediction_type_ == "epsilon") {
-      return (sample - sigma_t_val * model_output) / alpha_t;
-    } else if (prediction_type_ == "v_prediction") {
-      return alpha_t * sample - sigma_t_val * model_output;
-    } else if (prediction_type_ == "sample") {
-      return model_output;
-    } else {
-      throw std::runtime_error(
-          prediction_type_ +
-          " is not implemented for DPMSolverMultistepScheduler");
+    if (num_inference_steps_) {
+      precompute_coefficients();
     }
   }
 
-  xt::xarray<float> dpm_solver_first_order_update(
-      const xt::xarray<float> &model_output, const xt::xarray<float> &sample) {
-    float sigma_next = sigmas_(step_index_.value() + 1);
-    float sigma_curr = sigmas_(step_index_.value());
-    auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigma_next);
-    auto [alpha_s, sigma_s_val] = _sigma_to_alpha_sigma_t(sigma_curr);
-
-    float lambda_t = std::log(alpha_t) - std::log(sigma_t_val);
-    float lambda_s = std::log(alpha_s) - std::log(sigma_s_val);
-    float h = lambda_t - lambda_s;
-
-    return (sigma_t_val / sigma_s_val) * sample -
-           alpha_t * (std::exp(-h) - 1.0f) * model_output;
-  }
-
-  xt::xarray<float> multistep_dpm_solver_second_order_update(
-      const std::vector<xt::xarray<float>> &model_output_list,
-      const xt::xarray<float> &sample) {
-    float sigma_next = sigmas_(step_index_.value() + 1);
-    float sigma_s0 = sigmas_(step_index_.value());
-    float sigma_s1 = sigmas_(step_index_.value() - 1);
-
-    auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigma_next);
-    auto [alpha_s0, sigma_s0_val] = _sigma_to_alpha_sigma_t(sigma_s0);
-    auto [alpha_s1, sigma_s1_val] = _sigma_to_alpha_sigma_t(sigma_s1);
-
-    float lambda_t = std::log(alpha_t) - std::log(sigma_t_val);
-    float lambda_s0_ = std::log(alpha_s0) - std::log(sigma_s0_val);
-    float lambda_s1_ = std::log(alpha_s1) - std::log(sigma_s1_val);
-
-    const auto &m0 = model_output_list.back();
-    const auto &m1 = model_output_list[model_output_list.size() - 2];
-
-    float h = lambda_t - lambda_s0_;
-    float h_0 = lambda_s0_ - lambda_s1_;
-    float r0 = h_0 / h;
-
-    xt::xarray<float> D0 = m0;
-    xt::xarray<float> D1 = (1.0f / r0) * (m0 - m1);
-
-    return (sigma_t_val / sigma_s0_val) * sample -
-           (alpha_t * (std::exp(-h) - 1.0f)) * D0 -
-           0.5f * (alpha_t * (std::exp(-h) - 1.0f)) * D1;
-  }
-
-  xt::xarray<float> multistep_dpm_solver_third_order_update(
-      const std::vector<xt::xarray<float>> &model_output_list,
-      const xt::xarray<float> &sample) {
-    float sigma_next = sigmas_(step_index_.value() + 1);
-    float sigma_s0 = sigmas_(step_index_.value());
-    float sigma_s1 = sigmas_(step_index_.value() - 1);
-    float sigma_s2 = sigmas_(step_index_.value() - 2);
-
-    auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigma_next);
-    auto [alpha_s0, sigma_s0_val] = _sigma_to_alpha_sigma_t(sigma_s0);
-    auto [alpha_s1, sigma_s1_val] = _sigma_to_alpha_sigma_t(sigma_s1);
-    auto [alpha_s2, sigma_s2_val] = _sigma_to_alpha_sigma_t(sigma_s2);
-
-    float lambda_t = std::log(alpha_t) - std::log(sigma_t_val);
-    float lambda_s0_ = std::log(alpha_s0) - std::log(sigma_s0_val);
-    float lambda_s1_ = std::log(alpha_s1) - std::log(sigma_s1_val);
-    float lambda_s2_ = std::log(alpha_s2) - std::log(sigma_s2_val);
-
-    const auto &m0 = model_output_list.back();
-    const auto &m1 = model_output_list[model_output_list.size() - 2];
-    const auto &m2 = model_output_list[model_output_list.size() - 3];
-
-    float h = lambda_t - lambda_s0_;
-    float h_0 = lambda_s0_ - lambda_s1_;
-    float h_1 = lambda_s1_ - lambda_s2_;
-    float r0 = h_0 / h;
-    float r1 = h_1 / h;
-
-    xt::xarray<float> D0 = m0;
-    xt::xarray<float> D1_0 = (1.0f / r0) * (m0 - m1);
-    xt::xarray<float> D1_1 = (1.0f / r1) * (m1 - m2);
-    xt::xarray<float> D1 = D1_0 + (r0 / (r0 + r1)) * (D1_0 - D1_1);
-    xt::xarray<float> D2 = (1.0f / (r0 + r1)) * (D1_0 - D1_1);
-
-    return (sigma_t_val / sigma_s0_val) * sample -
-           (alpha_t * (std::exp(-h) - 1.0f)) * D0 +
-           (alpha_t * ((std::exp(-h) - 1.0f) / h + 1.0f)) * D1 -
-           (alpha_t * ((std::exp(-h) - 1.0f + h) / (h * h) - 0.5f)) * D2;
-  }
-
+  // The second match if timestep occurs more than once, the last index if
+  // it does not occur. Runs on the first step, so it does not allocate.
   int index_for_timestep(int timestep) const {
-    std::vector<size_t> indices;
+    int first = -1;
     for (size_t i = 0; i < timesteps_.size(); ++i) {
       if (timesteps_(i) == timestep) {
-        indices.push_back(i);
+        if (first >= 0) {
+          return int(i);
+        }
+        first = int(i);
       }
     }
-    if (indices.empty()) {
-      return int(timesteps_.size()) - 1;
-    } else if (indices.size() > 1) {
-      return int(indices[1]);
-    } else {
-      return int(indices[0]);
-    }
+    return first >= 0 ? first : int(timesteps_.size()) - 1;
   }
 
   SchedulerOutput step(const xt::xarray<float> &model_output, int timestep,
                        const xt::xarray<float> &sample) {
+    xt::xarray<float> prev_sample = sample;
+    step(model_output.data(), timestep, prev_sample.data(), prev_sample.size());
+    return {prev_sample};
+  }
+
+  // step() on raw buffers: updates the n floats of sample in place.
+  void step(const float *model_output, int timestep, float *sample, size_t n) {
+    step(model_output, nullptr, 1.0f, timestep, sample, n, nullptr, 0);
+  }
+
+  // Classifier-free guidance and step() fused into one SIMD pass over
+  // memory for the denoising loop. Combines the UNet output halves
+  // (noise_pred_text is nullptr without CFG), converts the result to a data
+  // prediction, updates sample in place and also writes the new sample to
+  // the num_copies buffers in copies, e.g. the halves of the next UNet
+  // input. The weights come from the table set_timesteps() fills and the
+  // model outputs from a ring buffer sized by the first call (or by
+  // reserve()), so steps do no math beyond the pass and do not allocate.
+  void step(const float *noise_pred_uncond, const float *noise_pred_text,
+            float guidance_scale, int timestep, float *sample, size_t n,
+            float *const *copies, int num_copies) override {
     if (!num_inference_steps_) {
       throw std::runtime_error("set_timesteps must be called before stepping");
     }
@@ -224,14 +139,9 @@ class DPMSolverMultistepScheduler {
     if (!step_index_) {
       step_index_ = index_for_timestep(timestep);
     }
-
-    xt::xarray<float> converted_output =
-        convert_model_output(model_output, sample);
-
-    for (int i = 0; i < solver_order_ - 1; ++i) {
-      model_outputs_[i] = model_outputs_[i + 1];
+    if (history_size_ != n) {
+      reserve(n);
     }
-    model_outputs_.back() = converted_output;
 
     bool lower_order_final =
         (step_index_.value() == int(timesteps_.size()) - 1) ||
@@ -240,16 +150,39 @@ class DPMSolverMultistepScheduler {
         (step_index_.value() == int(timesteps_.size()) - 2) &&
         lower_order_final_ && timesteps_.size() < 15;
 
-    xt::xarray<float> prev_sample;
+    int order;
     if (solver_order_ == 1 || lower_order_nums_ < 1 || lower_order_final) {
-      prev_sample = dpm_solver_first_order_update(converted_output, sample);
+      order = 1;
     } else if (solver_order_ == 2 || lower_order_nums_ < 2 ||
                lower_order_second) {
-      prev_sample =
-          multistep_dpm_solver_second_order_update(model_outputs_, sample);
+      order = 2;
     } else {
-      prev_sample =
-          multistep_dpm_solver_third_order_update(model_outputs_, sample);
+      order = 3;
+    }
+
+    history_head_ = (history_head_ + 1) % solver_order_;
+    FusedStep buffers{noise_pred_uncond,
+                      noise_pred_text,
+                      guidance_scale,
+                      sample,
+                      history_slot(0),
+                      order >= 2 ? history_slot(1) : nullptr,
+                      order >= 3 ? history_slot(2) : nullptr,
+                      copies,
+                      num_copies,
+                      n};
+    const StepCoefficients &c =
+        coefficients_[step_index_.value() * max_order() + order - 1];
+    switch (order) {
+      case 1:
+        fused_update<1>(buffers, c);
+        break;
+      case 2:
+        fused_update<2>(buffers, c);
+        break;
+      default:
+        fused_update<3>(buffers, c);
+        break;
     }
 
     if (lower_order_nums_ < solver_order_) {
@@ -257,14 +190,22 @@ class DPMSolverMultistepScheduler {
     }
 
     step_index_ = step_index_.value() + 1;
-    return {prev_sample};
   }
 
-  void set_begin_index(int begin_index) { begin_index_ = begin_index; }
+  // Sizes the model output history for samples of n floats up front, so
+  // that not even the first step on raw buffers allocates.
+  void reserve(size_t n) override {
+    history_.assign(solver_order_ * n, 0.0f);
+    history_size_ = n;
+  }
+
+  void set_begin_index(int begin_index) override {
+    begin_index_ = begin_index;
+  }
 
   xt::xarray<float> add_noise(const xt::xarray<float> &original_samples,
                               const xt::xarray<float> &noise,
-                              const xt::xarray<int> &timesteps) const {
+                              const xt::xarray<int> &timesteps) const override {
     std::vector<int> step_indices;
 
     if (!begin_index_) {
@@ -293,7 +234,9 @@ class DPMSolverMultistepScheduler {
     return alpha_t * original_samples + sigma_t * noise;
   }
 
-  const xt::xarray<float> &get_timesteps() const { return timesteps_; }
+  const xt::xarray<float> &get_timesteps() const override {
+    return timesteps_;
+  }
   size_t get_step_index() const { return step_index_.value_or(0); }
 
   const xt::xarray<float> &get_betas() const { return betas_; }
@@ -314,6 +257,168 @@ class DPMSolverMultistepScheduler {
   }
 
  private:
+  int max_order() const { return std::min(solver_order_, 3); }
+
+  // Model output k steps back; slot 0 is the current step's.
+  float *history_slot(int k) {
+    int slot = (history_head_ + solver_order_ - k) % solver_order_;
+    return history_.data() + slot * history_size_;
+  }
+
+  // Per-step weights of the fused update, with d0 the data prediction of
+  // this step and d1, d2 those of the two steps before:
+  //   d0 = convert_sample * x + convert_output * noise_pred
+  //   x' = sample * x + m0 * d0 + m1 * d1 + m2 * d2
+  struct StepCoefficients {
+    float convert_sample = 0.0f;
+    float convert_output = 0.0f;
+    float sample = 0.0f;
+    float m0 = 0.0f;
+    float m1 = 0.0f;
+    float m2 = 0.0f;
+  };
+
+  struct FusedStep {
+    const float *noise_pred_uncond;
+    const float *noise_pred_text;
+    float guidance_scale;
+    float *sample;
+    float *m0;
+    const float *m1;
+    const float *m2;
+    float *const *copies;
+    int num_copies;
+    size_t n;
+  };
+
+  // Fills coefficients_ with the weights of every step index and every
+  // order up to max_order(): the conversion to a data prediction plus the
+  // first, second and third order multistep updates of diffusers, expanded
+  // into one weight per model output in the history.
+  void precompute_coefficients() {
+    if (prediction_type_ != "epsilon" && prediction_type_ != "v_prediction" &&
+        prediction_type_ != "sample") {
+      throw std::runtime_error(
+          prediction_type_ +
+          " is not implemented for DPMSolverMultistepScheduler");
+    }
+
+    auto lambda = [this](int index) {
+      auto [alpha, sigma] = _sigma_to_alpha_sigma_t(sigmas_(index));
+      return std::log(alpha) - std::log(sigma);
+    };
+
+    size_t steps = timesteps_.size();
+    coefficients_.assign(steps * max_order(), StepCoefficients());
+    for (size_t index = 0; index < steps; index++) {
+      auto [alpha_s0, sigma_s0_val] = _sigma_to_alpha_sigma_t(sigmas_(index));
+      auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigmas_(index + 1));
+      float lambda_t = std::log(alpha_t) - std::log(sigma_t_val);
+      float lambda_s0_ = std::log(alpha_s0) - std::log(sigma_s0_val);
+      float h = lambda_t - lambda_s0_;
+      float d0_scale = alpha_t * (std::exp(-h) - 1.0f);
+
+      StepCoefficients base;
+      if (prediction_type_ == "epsilon") {
+        base.convert_sample = 1.0f / alpha_s0;
+        base.convert_output = -sigma_s0_val / alpha_s0;
+      } else if (prediction_type_ == "v_prediction") {
+        base.convert_sample = alpha_s0;
+        base.convert_output = -sigma_s0_val;
+      } else {
+        base.convert_sample = 0.0f;
+        base.convert_output = 1.0f;
+      }
+      base.sample = sigma_t_val / sigma_s0_val;
+
+      StepCoefficients *row = &coefficients_[index * max_order()];
+      row[0] = base;
+      row[0].m0 = -d0_scale;
+      if (max_order() < 2 || index < 1) {
+        continue;
+      }
+      float lambda_s1_ = lambda(index - 1);
+      float r0 = (lambda_s0_ - lambda_s1_) / h;
+      // D0 = m0, D1 = (m0 - m1) / r0
+      row[1] = base;
+      row[1].m0 = -d0_scale - 0.5f * d0_scale / r0;
+      row[1].m1 = 0.5f * d0_scale / r0;
+      if (max_order() < 3 || index < 2) {
+        continue;
+      }
+      float lambda_s2_ = lambda(index - 2);
+      float r1 = (lambda_s1_ - lambda_s2_) / h;
+      // D1 = (1 + k) D1_0 - k D1_1 and D2 = (D1_0 - D1_1) / (r0 + r1)
+      // with D1_0 = (m0 - m1) / r0 and D1_1 = (m1 - m2) / r1.
+      float d1_scale = alpha_t * ((std::exp(-h) - 1.0f) / h + 1.0f);
+      float d2_scale = alpha_t * ((std::exp(-h) - 1.0f + h) / (h * h) - 0.5f);
+      float k = r0 / (r0 + r1);
+      float d1_0 = d1_scale * (1.0f + k) - d2_scale / (r0 + r1);
+      float d1_1 = -d1_scale * k + d2_scale / (r0 + r1);
+      row[2] = base;
+      row[2].m0 = -d0_scale + d1_0 / r0;
+      row[2].m1 = -d1_0 / r0 + d1_1 / r1;
+      row[2].m2 = -d1_1 / r1;
+    }
+  }
+
+  // Reads every input and writes every output exactly once per element.
+  template <int Order>
+  static void fused_update(const FusedStep &s, const StepCoefficients &c) {
+    using batch = xsimd::batch<float>;
+    constexpr size_t width = batch::size;
+    const batch guidance(s.guidance_scale);
+    const batch convert_sample(c.convert_sample);
+    const batch convert_output(c.convert_output);
+    const batch sample_weight(c.sample);
+    const batch m0_weight(c.m0);
+    const batch m1_weight(c.m1);
+    const batch m2_weight(c.m2);
+
+    size_t i = 0;
+    for (; i + width <= s.n; i += width) {
+      batch noise = batch::load_unaligned(s.noise_pred_uncond + i);
+      if (s.noise_pred_text) {
+        batch text = batch::load_unaligned(s.noise_pred_text + i);
+        noise = xsimd::fma(guidance, text - noise, noise);
+      }
+      batch x = batch::load_unaligned(s.sample + i);
+      batch m0 = xsimd::fma(convert_sample, x, convert_output * noise);
+      m0.store_unaligned(s.m0 + i);
+      batch next = xsimd::fma(sample_weight, x, m0_weight * m0);
+      if constexpr (Order >= 2) {
+        next = xsimd::fma(m1_weight, batch::load_unaligned(s.m1 + i), next);
+      }
+      if constexpr (Order >= 3) {
+        next = xsimd::fma(m2_weight, batch::load_unaligned(s.m2 + i), next);
+      }
+      next.store_unaligned(s.sample + i);
+      for (int copy = 0; copy < s.num_copies; copy++) {
+        next.store_unaligned(s.copies[copy] + i);
+      }
+    }
+    for (; i < s.n; i++) {
+      float noise = s.noise_pred_uncond[i];
+      if (s.noise_pred_text) {
+        noise = std::fma(s.guidance_scale, s.noise_pred_text[i] - noise, noise);
+      }
+      float x = s.sample[i];
+      float m0 = std::fma(c.convert_sample, x, c.convert_output * noise);
+      s.m0[i] = m0;
+      float next = std::fma(c.sample, x, c.m0 * m0);
+      if constexpr (Order >= 2) {
+        next = std::fma(c.m1, s.m1[i], next);
+      }
+      if constexpr (Order >= 3) {
+        next = std::fma(c.m2, s.m2[i], next);
+      }
+      s.sample[i] = next;
+      for (int copy = 0; copy < s.num_copies; copy++) {
+        s.copies[copy][i] = next;
+      }
+    }
+  }
+
   int num_train_timesteps_;
   float beta_start_;
   float beta_end_;
@@ -333,7 +438,13 @@ class DPMSolverMultistepScheduler {
 
   std::optional<int> num_inference_steps_;
   xt::xarray<float> timesteps_;
-  std::vector<xt::xarray<float>> model_outputs_;
+  // Weights of step index i and order o at [i * max_order() + o - 1].
+  std::vector<StepCoefficients> coefficients_;
+  // Ring of the last solver_order_ data predictions, history_size_ floats
+  // each; history_head_ is the current step's slot.
+  std::vector<float, xsimd::aligned_allocator<float, 64>> history_;
+  size_t history_size_ = 0;
+  int history_head_ = 0;
   int lower_order_nums_;
   std::optional<int> step_index_;
   std::optional<int> begin_index_;
@@ -0,0 +1,111 @@
+#ifndef EMBEDDINGCACHE_HPP
+#define EMBEDDINGCACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct TextEmbedding {
+  std::vector<float> text_embedding;
+
+  size_t bytes() const { return text_embedding.size() * sizeof(float); }
+};
+
+// LRU cache of CLIP outputs bounded by payload bytes. A hit lets a request
+// skip both tokenization and the CLIP graph.
+class TextEmbeddingCache {
+ public:
+  explicit TextEmbeddingCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  static std::string makeKey(const std::string &prompt,
+                             const std::string &negative_prompt, bool use_cfg,
+                             int text_embedding_size,
+                             const std::string &clip_model_id) {
+    // Length-prefixed so that no two field combinations collide.
+    std::string key;
+    key.reserve(prompt.size() + negative_prompt.size() +
+                clip_model_id.size() + 32);
+    key += std::to_string(prompt.size()) + ':' + prompt;
+    key += std::to_string(negative_prompt.size()) + ':' + negative_prompt;
+    key += use_cfg ? "c1" : "c0";
+    key += std::to_string(text_embedding_size) + ':';
+    key += clip_model_id;
+    return key;
+  }
+
+  std::shared_ptr<const TextEmbedding> get(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+
+  void put(const std::string &key,
+           std::shared_ptr<const TextEmbedding> embedding) {
+    size_t size = embedding->bytes();
+    if (size > max_bytes_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      bytes_ -= it->second->second->bytes();
+      entries_.erase(it->second);
+      index_.erase(it);
+    }
+    entries_.emplace_front(key, std::move(embedding));
+    index_[key] = entries_.begin();
+    bytes_ += size;
+    while (bytes_ > max_bytes_) {
+      auto &last = entries_.back();
+      bytes_ -= last.second->bytes();
+      index_.erase(last.first);
+      entries_.pop_back();
+    }
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  uint64_t hits() const { return hits_.load(); }
+  uint64_t misses() const { return misses_.load(); }
+
+  size_t entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  size_t max_bytes() const { return max_bytes_; }
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const TextEmbedding>>;
+
+  const size_t max_bytes_;
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+#endif  // EMBEDDINGCACHE_HPP
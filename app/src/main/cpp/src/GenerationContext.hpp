@@ -0,0 +1,78 @@
+#ifndef GENERATIONCONTEXT_HPP
+#define GENERATIONCONTEXT_HPP
+
+#include <QnnTypes.h>
+
+#include <vector>
+#include <xsimd/xsimd.hpp>
+
+#include "Config.hpp"
+
+// Cache-line aligned so SIMD loops over it start on a full vector.
+using AlignedFloats = std::vector<float, xsimd::aligned_allocator<float, 64>>;
+
+struct UnetInput {
+  AlignedFloats latents;  // batch x 4 x sample_size x sample_size
+  int timestep = 0;
+  AlignedFloats text_embedding;  // batch x 77 x text_embedding_size
+  // Guidance scale embedding for UNets that take one (LCM-distilled),
+  // empty otherwise.
+  AlignedFloats timestep_cond;
+};
+
+struct UnetOutput {
+  AlignedFloats latents;  // noise prediction, same layout as the input
+};
+
+struct VaeEncoderOutput {
+  AlignedFloats mean;
+  AlignedFloats std;
+};
+
+// Shapes, flags and buffers of one generation. It is passed explicitly
+// through the pipeline and into QnnModel, so jobs of different sizes and
+// model sets can be in flight at the same time without sharing state.
+// With CFG the batch holds the unconditional half first. Every buffer is
+// sized once here, so the denoising loop itself does not allocate.
+struct GenerationContext {
+  GenerationContext(int output_size, int text_embedding_size, bool use_cfg)
+      : output_size(output_size),
+        sample_size(output_size / 8),
+        text_embedding_size(text_embedding_size),
+        use_cfg(use_cfg) {
+    unet_input.latents.resize(batchSize() * latentSize());
+    unet_input.text_embedding.resize(batchSize() * embeddingSize());
+    unet_output.latents.resize(batchSize() * latentSize());
+    latents.resize(latentSize());
+  }
+
+  // Owns the UNet IO tensors; QnnModel::releaseUnetTensors() frees them.
+  GenerationContext(const GenerationContext &) = delete;
+  GenerationContext &operator=(const GenerationContext &) = delete;
+
+  int batchSize() const { return use_cfg ? 2 : 1; }
+  // Element counts of one batch item.
+  int latentSize() const { return 4 * sample_size * sample_size; }
+  int imageSize() const { return 3 * output_size * output_size; }
+  int embeddingSize() const { return 77 * text_embedding_size; }
+
+  const int output_size;
+  const int sample_size;
+  const int text_embedding_size;
+  const bool use_cfg;
+  bool img2img = false;
+  bool use_safety_checker = false;
+  float nsfw_threshold = default_nsfw_threshold;
+
+  UnetInput unet_input;
+  UnetOutput unet_output;
+  VaeEncoderOutput vae_encoder_output;
+  // The image being denoised, updated in place by every scheduler step.
+  AlignedFloats latents;
+  // This job's UNet IO tensors, set up by its first UNet step. Keeping them
+  // per job lets several jobs take turns on the same graph.
+  Qnn_Tensor_t *unet_inputs = nullptr;
+  Qnn_Tensor_t *unet_outputs = nullptr;
+};
+
+#endif  // GENERATIONCONTEXT_HPP
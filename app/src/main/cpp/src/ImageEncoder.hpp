@@ -0,0 +1,186 @@
+#ifndef IMAGEENCODER_HPP
+#define IMAGEENCODER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JobQueue.hpp"
+#include "SDUtils.hpp"
+#include "Trace.hpp"
+
+enum class ImageFormat { RAW, PNG, JPEG };
+
+inline bool parseImageFormat(const std::string &name, ImageFormat &format) {
+  if (name == "raw") {
+    format = ImageFormat::RAW;
+  } else if (name == "png") {
+    format = ImageFormat::PNG;
+  } else if (name == "jpeg" || name == "jpg") {
+    format = ImageFormat::JPEG;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char *imageFormatName(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::PNG:
+      return "png";
+    case ImageFormat::JPEG:
+      return "jpeg";
+    default:
+      return "raw";
+  }
+}
+
+inline const char *imageContentType(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::PNG:
+      return "image/png";
+    case ImageFormat::JPEG:
+      return "image/jpeg";
+    default:
+      return "application/octet-stream";
+  }
+}
+
+// Picks the first media type in an Accept header that we can produce.
+// Quality values are ignored; wildcards never match.
+inline bool negotiateImageFormat(const std::string &accept,
+                                 ImageFormat &format) {
+  std::stringstream ss(accept);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    auto type = item.substr(0, item.find(';'));
+    type.erase(0, type.find_first_not_of(" \t"));
+    type.erase(type.find_last_not_of(" \t") + 1);
+    if (type == "image/png") {
+      format = ImageFormat::PNG;
+      return true;
+    }
+    if (type == "image/jpeg") {
+      format = ImageFormat::JPEG;
+      return true;
+    }
+    if (type == "application/octet-stream") {
+      format = ImageFormat::RAW;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct EncodeRequest {
+  std::vector<uint8_t> pixels;
+  int width;
+  int height;
+  int channels;
+  ImageFormat format;
+  int quality;
+  // Called on the encoder thread, which hands over the encoded bytes.
+  std::function<void(bool ok, std::vector<uint8_t> &&encoded)> done;
+};
+
+// Compresses finished images off the inference thread so the accelerator
+// can start the next job while the previous result is being encoded.
+class ImageEncoder {
+ public:
+  // observer, if set, is called on the encoder thread with the time each
+  // queued encode took.
+  using Observer = std::function<void(const EncodeRequest &, double ms)>;
+
+  explicit ImageEncoder(size_t capacity, int png_compression_level = 1,
+                        Observer observer = nullptr)
+      : observer_(std::move(observer)), queue_(capacity) {
+    stbi_write_png_compression_level = png_compression_level;
+    worker_ = std::thread([this] { run(); });
+  }
+
+  ~ImageEncoder() {
+    queue_.close();
+    worker_.join();
+  }
+
+  ImageEncoder(const ImageEncoder &) = delete;
+  ImageEncoder &operator=(const ImageEncoder &) = delete;
+
+  // Falls back to encoding on the calling thread if the queue is full.
+  void submit(EncodeRequest request) {
+    if (!queue_.try_push(std::move(request))) {
+      std::vector<uint8_t> encoded;
+      bool ok = encode(request, encoded);
+      request.done(ok, std::move(encoded));
+    }
+  }
+
+  static bool encode(const EncodeRequest &request,
+                     std::vector<uint8_t> &out) {
+    out.clear();
+    auto write = [](void *context, void *data, int size) {
+      auto &buffer = *static_cast<std::vector<uint8_t> *>(context);
+      buffer.insert(buffer.end(), static_cast<uint8_t *>(data),
+                    static_cast<uint8_t *>(data) + size);
+    };
+    switch (request.format) {
+      case ImageFormat::PNG:
+        return stbi_write_png_to_func(write, &out, request.width,
+                                      request.height, request.channels,
+                                      request.pixels.data(),
+                                      request.width * request.channels) != 0;
+      case ImageFormat::JPEG:
+        return stbi_write_jpg_to_func(write, &out, request.width,
+                                      request.height, request.channels,
+                                      request.pixels.data(),
+                                      request.quality) != 0;
+      default:
+        out.assign(request.pixels.begin(), request.pixels.end());
+        return true;
+    }
+  }
+
+ private:
+  void run() {
+    EncodeRequest request;
+    while (queue_.pop(request)) {
+      auto start = std::chrono::high_resolution_clock::now();
+      bool ok;
+      std::vector<uint8_t> encoded;
+      encoded.reserve(size_hint_);
+      {
+        TraceSpan span("encode");
+        ok = encode(request, encoded);
+      }
+      size_hint_ = std::max(size_hint_, encoded.size());
+      auto end = std::chrono::high_resolution_clock::now();
+      if (observer_) {
+        observer_(request,
+                  std::chrono::duration<double, std::milli>(end - start)
+                      .count());
+      }
+      std::cout << imageFormatName(request.format) << " encoding time: "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       end - start)
+                       .count()
+                << " ms, " << encoded.size() << " bytes" << std::endl;
+      request.done(ok, std::move(encoded));
+    }
+  }
+
+  Observer observer_;
+  // Largest encoded size so far. Each image gets one buffer of that capacity,
+  // which the done callback takes over, so it is neither regrown while
+  // encoding nor copied afterwards.
+  size_t size_hint_ = 0;
+  BoundedJobQueue<EncodeRequest> queue_;
+  std::thread worker_;
+};
+
+#endif  // IMAGEENCODER_HPP
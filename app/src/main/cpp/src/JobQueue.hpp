@@ -0,0 +1,240 @@
+#ifndef JOBQUEUE_HPP
+#define JOBQUEUE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bounded multi-producer / single-consumer queue. HTTP handler threads push
+// jobs, the inference worker is the only consumer.
+template <typename T>
+class BoundedJobQueue {
+ public:
+  explicit BoundedJobQueue(size_t capacity) : capacity_(capacity) {}
+
+  // Returns false immediately when the queue is full or closed. A rejected
+  // item is left untouched.
+  bool try_push(T &&item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || items_.size() >= capacity_) {
+        return false;
+      }
+      items_.push_back(std::move(item));
+    }
+    cond_.notify_one();
+    return true;
+  }
+
+  bool try_push(const T &item) {
+    T copy(item);
+    return try_push(std::move(copy));
+  }
+
+  // Blocks until an item is available. Returns false once the queue is
+  // closed and drained, or without an item after interrupt().
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock,
+               [this] { return closed_ || interrupted_ || !items_.empty(); });
+    interrupted_ = false;
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    return true;
+  }
+
+  // Like pop() but returns false right away when nothing is queued.
+  bool try_pop(T &item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    return true;
+  }
+
+  // 1-based position of item in the queue, 0 if it is not queued (anymore).
+  int position(const T &item) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find(items_.begin(), items_.end(), item);
+    if (it == items_.end()) {
+      return 0;
+    }
+    return static_cast<int>(it - items_.begin()) + 1;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cond_.notify_all();
+  }
+
+  bool closed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+
+  // Wakes the consumer out of pop() (or makes its next pop() return right
+  // away) so that it can pick up work that does not come through the queue.
+  void interrupt() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      interrupted_ = true;
+    }
+    cond_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<T> items_;
+  bool closed_ = false;
+  bool interrupted_ = false;
+};
+
+// Per-job log of serialized SSE events, written by the inference worker and
+// read by any number of httplib threads. Events are kept for the lifetime
+// of the job and numbered from 1, so a client that reconnects with the last
+// id it saw gets everything after it replayed.
+class EventChannel {
+ public:
+  struct Event {
+    uint64_t id;
+    std::shared_ptr<const std::string> data;
+  };
+
+  uint64_t push(std::string event) {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      events_.push_back(std::make_shared<const std::string>(std::move(event)));
+      id = events_.size();
+    }
+    cond_.notify_all();
+    return id;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cond_.notify_all();
+  }
+
+  // Waits up to timeout for events with an id greater than after and
+  // appends them to out. Returns false if there were none.
+  bool read(uint64_t after, std::vector<Event> &out,
+            std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, timeout,
+                   [&] { return closed_ || events_.size() > after; });
+    if (events_.size() <= after) {
+      return false;
+    }
+    for (uint64_t id = after + 1; id <= events_.size(); id++) {
+      out.push_back({id, events_[id - 1]});
+    }
+    return true;
+  }
+
+  // True once the channel is closed and a reader at after has seen
+  // everything.
+  bool done(uint64_t after) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && events_.size() <= after;
+  }
+
+  bool closed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cond_;
+  std::vector<std::shared_ptr<const std::string>> events_;
+  bool closed_ = false;
+};
+
+// Id -> job lookup for jobs that are queued or running, used by endpoints
+// that address a job after /generate has returned (e.g. /cancel/{id}).
+// Finished jobs can be kept around so clients can still fetch their events
+// and results; the oldest ones are dropped past retain_finished.
+template <typename T>
+class JobRegistry {
+ public:
+  explicit JobRegistry(size_t retain_finished = 0)
+      : retain_finished_(retain_finished), rng_(std::random_device{}()) {}
+
+  std::string add(std::shared_ptr<T> job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string id;
+    do {
+      char buf[17];
+      snprintf(buf, sizeof(buf), "%016llx",
+               static_cast<unsigned long long>(rng_()));
+      id = buf;
+    } while (jobs_.count(id));
+    jobs_[id] = std::move(job);
+    return id;
+  }
+
+  std::shared_ptr<T> find(const std::string &id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+      return nullptr;
+    }
+    return it->second;
+  }
+
+  void remove(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.erase(id);
+  }
+
+  // Keeps a finished job findable until retain_finished newer jobs have
+  // finished after it.
+  void finish(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_.push_back(id);
+    while (finished_.size() > retain_finished_) {
+      jobs_.erase(finished_.front());
+      finished_.pop_front();
+    }
+  }
+
+ private:
+  const size_t retain_finished_;
+  mutable std::mutex mutex_;
+  std::deque<std::string> finished_;
+  std::mt19937_64 rng_;
+  std::unordered_map<std::string, std::shared_ptr<T>> jobs_;
+};
+
+#endif  // JOBQUEUE_HPP
@@ -0,0 +1,294 @@
+// self-implemented LCMScheduler class, following diffusers without
+// thresholding or clipping of the denoised sample
+#ifndef LCMSCHEDULER_HPP
+#define LCMSCHEDULER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <xtensor/xarray.hpp>
+#include <xtensor/xmanipulation.hpp>
+#include <xtensor/xmath.hpp>
+#include <xtensor/xview.hpp>
+#include <xsimd/xsimd.hpp>
+
+#include "Scheduler.hpp"
+
+// Multistep latent consistency sampling. Every step maps the sample straight
+// to a denoised estimate and, except for the last, noises that back up to
+// the next timestep, so LCM-distilled UNets need only 2-8 evaluations. The
+// timesteps are a subset of the original_inference_steps ones the model was
+// distilled on.
+class LCMScheduler : public Scheduler {
+ public:
+  LCMScheduler(int num_train_timesteps, float beta_start, float beta_end,
+               const std::string &beta_schedule,
+               int original_inference_steps,
+               const std::string &prediction_type)
+      : num_train_timesteps_(num_train_timesteps),
+        beta_start_(beta_start),
+        beta_end_(beta_end),
+        beta_schedule_(beta_schedule),
+        original_inference_steps_(original_inference_steps),
+        prediction_type_(prediction_type) {
+    if (beta_schedule == "scaled_linear") {
+      float beta_start_sqrt = std::sqrt(beta_start_);
+      float beta_end_sqrt = std::sqrt(beta_end_);
+      betas_ = xt::pow(xt::linspace<float>(beta_start_sqrt, beta_end_sqrt,
+                                           num_train_timesteps),
+                       2.0f);
+    } else {
+      throw std::runtime_error(beta_schedule + " is not implemented");
+    }
+
+    alphas_ = 1.0f - betas_;
+    alphas_cumprod_ = xt::cumprod(alphas_);
+  }
+
+  void set_timesteps(int num_inference_steps) override {
+    if (num_inference_steps > original_inference_steps_) {
+      throw std::invalid_argument(
+          "LCMScheduler supports at most " +
+          std::to_string(original_inference_steps_) + " steps");
+    }
+    num_inference_steps_ = num_inference_steps;
+
+    // Every k-th training timestep, evenly subsampled from the end.
+    int k = num_train_timesteps_ / original_inference_steps_;
+    timesteps_ = xt::zeros<float>({size_t(num_inference_steps)});
+    for (int i = 0; i < num_inference_steps; i++) {
+      int index = int(std::floor(double(i) * original_inference_steps_ /
+                                 num_inference_steps));
+      timesteps_(i) = float((original_inference_steps_ - index) * k - 1);
+    }
+
+    precompute_coefficients();
+
+    step_index_ = std::nullopt;
+    begin_index_ = std::nullopt;
+  }
+
+  // The second match if timestep occurs more than once, the last index if
+  // it does not occur. Runs on the first step, so it does not allocate.
+  int index_for_timestep(int timestep) const {
+    int first = -1;
+    for (size_t i = 0; i < timesteps_.size(); ++i) {
+      if (timesteps_(i) == timestep) {
+        if (first >= 0) {
+          return int(i);
+        }
+        first = int(i);
+      }
+    }
+    return first >= 0 ? first : int(timesteps_.size()) - 1;
+  }
+
+  SchedulerOutput step(const xt::xarray<float> &model_output, int timestep,
+                       const xt::xarray<float> &sample) {
+    xt::xarray<float> prev_sample = sample;
+    step(model_output.data(), timestep, prev_sample.data(), prev_sample.size());
+    return {prev_sample};
+  }
+
+  // step() on raw buffers: updates the n floats of sample in place.
+  void step(const float *model_output, int timestep, float *sample, size_t n) {
+    step(model_output, nullptr, 1.0f, timestep, sample, n, nullptr, 0);
+  }
+
+  // Guidance, the consistency function and the re-noising of one diffusers
+  // step fused into one SIMD pass like DPMSolverMultistepScheduler::step().
+  // The noise comes from this scheduler's own engine (see seed()), so jobs
+  // interleaved with this one do not change it.
+  void step(const float *noise_pred_uncond, const float *noise_pred_text,
+            float guidance_scale, int timestep, float *sample, size_t n,
+            float *const *copies, int num_copies) override {
+    if (!num_inference_steps_) {
+      throw std::runtime_error("set_timesteps must be called before stepping");
+    }
+
+    if (!step_index_) {
+      step_index_ = index_for_timestep(timestep);
+    }
+    if (noise_.size() != n) {
+      reserve(n);
+    }
+
+    const StepCoefficients &c = coefficients_[step_index_.value()];
+    if (c.noise != 0.0f) {
+      std::normal_distribution<float> dist(0.0f, 1.0f);
+      for (float &value : noise_) {
+        value = dist(engine_);
+      }
+    }
+
+    using batch = xsimd::batch<float>;
+    constexpr size_t width = batch::size;
+    const batch guidance(guidance_scale);
+    const batch sample_weight(c.sample);
+    const batch output_weight(c.output);
+    const batch noise_weight(c.noise);
+
+    size_t i = 0;
+    for (; i + width <= n; i += width) {
+      batch noise = batch::load_unaligned(noise_pred_uncond + i);
+      if (noise_pred_text) {
+        batch text = batch::load_unaligned(noise_pred_text + i);
+        noise = xsimd::fma(guidance, text - noise, noise);
+      }
+      batch x = batch::load_unaligned(sample + i);
+      batch next = xsimd::fma(
+          sample_weight, x,
+          xsimd::fma(noise_weight, batch::load_aligned(noise_.data() + i),
+                     output_weight * noise));
+      next.store_unaligned(sample + i);
+      for (int copy = 0; copy < num_copies; copy++) {
+        next.store_unaligned(copies[copy] + i);
+      }
+    }
+    for (; i < n; i++) {
+      float noise = noise_pred_uncond[i];
+      if (noise_pred_text) {
+        noise = std::fma(guidance_scale, noise_pred_text[i] - noise, noise);
+      }
+      float next = std::fma(c.sample, sample[i],
+                            std::fma(c.noise, noise_[i], c.output * noise));
+      sample[i] = next;
+      for (int copy = 0; copy < num_copies; copy++) {
+        copies[copy][i] = next;
+      }
+    }
+
+    step_index_ = step_index_.value() + 1;
+  }
+
+  // The initial latents are drawn from an mt19937 seeded with the same
+  // seed, so mix in a constant to get a different stream.
+  void seed(unsigned seed) override {
+    std::seed_seq sequence{seed, 1u};
+    engine_.seed(sequence);
+  }
+
+  // Sizes the noise buffer for samples of n floats up front, so that not
+  // even the first step allocates.
+  void reserve(size_t n) override { noise_.assign(n, 0.0f); }
+
+  void set_begin_index(int begin_index) override {
+    begin_index_ = begin_index;
+  }
+
+  // DDPM forward process at the given training timesteps.
+  xt::xarray<float> add_noise(const xt::xarray<float> &original_samples,
+                              const xt::xarray<float> &noise,
+                              const xt::xarray<int> &timesteps) const override {
+    xt::xarray<float> alpha_prod = xt::zeros<float>({timesteps.size()});
+    for (size_t i = 0; i < timesteps.size(); ++i) {
+      alpha_prod(i) = alphas_cumprod_(timesteps(i));
+    }
+
+    std::vector<size_t> new_shape = {alpha_prod.size(), 1, 1, 1};
+    auto reshaped_alpha_prod = xt::reshape_view(alpha_prod, new_shape);
+
+    return xt::sqrt(reshaped_alpha_prod) * original_samples +
+           xt::sqrt(1.0f - reshaped_alpha_prod) * noise;
+  }
+
+  const xt::xarray<float> &get_timesteps() const override {
+    return timesteps_;
+  }
+  size_t get_step_index() const { return step_index_.value_or(0); }
+  const xt::xarray<float> &get_alphas_cumprod() const {
+    return alphas_cumprod_;
+  }
+
+ private:
+  // x' = sample * x + output * noise_pred + noise * z, z ~ N(0, 1): the
+  // denoised estimate c_out * x0 + c_skip * x, scaled and noised to the next
+  // timestep unless this is the last step.
+  struct StepCoefficients {
+    float sample = 0.0f;
+    float output = 0.0f;
+    float noise = 0.0f;
+  };
+
+  // Boundary condition scalings c_skip and c_out of the consistency model.
+  static std::pair<float, float> scalings(int timestep) {
+    constexpr float sigma_data = 0.5f;
+    constexpr float timestep_scaling = 10.0f;
+    float scaled_timestep = timestep * timestep_scaling;
+    float c_skip = sigma_data * sigma_data /
+                   (scaled_timestep * scaled_timestep + sigma_data * sigma_data);
+    float c_out = scaled_timestep /
+                  std::sqrt(scaled_timestep * scaled_timestep +
+                            sigma_data * sigma_data);
+    return {c_skip, c_out};
+  }
+
+  void precompute_coefficients() {
+    if (prediction_type_ != "epsilon" && prediction_type_ != "v_prediction" &&
+        prediction_type_ != "sample") {
+      throw std::runtime_error(prediction_type_ +
+                               " is not implemented for LCMScheduler");
+    }
+
+    size_t steps = timesteps_.size();
+    coefficients_.assign(steps, StepCoefficients());
+    for (size_t index = 0; index < steps; index++) {
+      int timestep = int(timesteps_(index));
+      float alpha_prod_t = alphas_cumprod_(timestep);
+      float alpha_t = std::sqrt(alpha_prod_t);
+      float sigma_t = std::sqrt(1.0f - alpha_prod_t);
+
+      // x0 = convert_sample * x + convert_output * noise_pred
+      float convert_sample, convert_output;
+      if (prediction_type_ == "epsilon") {
+        convert_sample = 1.0f / alpha_t;
+        convert_output = -sigma_t / alpha_t;
+      } else if (prediction_type_ == "v_prediction") {
+        convert_sample = alpha_t;
+        convert_output = -sigma_t;
+      } else {
+        convert_sample = 0.0f;
+        convert_output = 1.0f;
+      }
+
+      auto [c_skip, c_out] = scalings(timestep);
+      StepCoefficients &c = coefficients_[index];
+      c.sample = c_out * convert_sample + c_skip;
+      c.output = c_out * convert_output;
+      if (index + 1 < steps) {
+        float alpha_prod_prev = alphas_cumprod_(int(timesteps_(index + 1)));
+        float alpha_prev = std::sqrt(alpha_prod_prev);
+        c.sample *= alpha_prev;
+        c.output *= alpha_prev;
+        c.noise = std::sqrt(1.0f - alpha_prod_prev);
+      }
+    }
+  }
+
+  int num_train_timesteps_;
+  float beta_start_;
+  float beta_end_;
+  std::string beta_schedule_;
+  int original_inference_steps_;
+  std::string prediction_type_;
+
+  xt::xarray<float> betas_;
+  xt::xarray<float> alphas_;
+  xt::xarray<float> alphas_cumprod_;
+
+  std::optional<int> num_inference_steps_;
+  xt::xarray<float> timesteps_;
+  std::vector<StepCoefficients> coefficients_;
+  std::mt19937 engine_;
+  // Fresh noise of the current step.
+  std::vector<float, xsimd::aligned_allocator<float, 64>> noise_;
+  std::optional<int> step_index_;
+  std::optional<int> begin_index_;
+};
+
+#endif  // LCMSCHEDULER_HPP
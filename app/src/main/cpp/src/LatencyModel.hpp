@@ -0,0 +1,56 @@
+#ifndef LATENCYMODEL_HPP
+#define LATENCYMODEL_HPP
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+enum class PipelineStage {
+  CLIP,
+  UNET_STEP,
+  VAE_ENCODE,
+  VAE_DECODE,
+  SAFETY_CHECK,
+  IMAGE_ENCODE,
+};
+
+// Online per-stage latency estimates (exponentially weighted moving
+// averages) fed from the pipeline's timing points. variant separates
+// configurations of one stage that cost differently, e.g. the output size
+// or whether CFG doubles the UNet batch.
+class LatencyModel {
+ public:
+  explicit LatencyModel(double alpha = 0.2) : alpha_(alpha) {}
+
+  void observe(PipelineStage stage, int variant, double ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto result = ewma_.emplace(std::make_pair(stage, variant), ms);
+    if (!result.second) {
+      double &value = result.first->second;
+      value += alpha_ * (ms - value);
+    }
+  }
+
+  // Returns false if the stage has not been observed for variant yet.
+  bool estimate(PipelineStage stage, int variant, double &ms) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ewma_.find(std::make_pair(stage, variant));
+    if (it == ewma_.end()) {
+      return false;
+    }
+    ms = it->second;
+    return true;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ewma_.clear();
+  }
+
+ private:
+  const double alpha_;
+  mutable std::mutex mutex_;
+  std::map<std::pair<PipelineStage, int>, double> ewma_;
+};
+
+#endif  // LATENCYMODEL_HPP
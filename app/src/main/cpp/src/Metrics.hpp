@@ -0,0 +1,174 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Minimal Prometheus-style metrics. Metrics are registered once at startup;
+// updating them afterwards only touches relaxed atomics, so the inference
+// loop never takes a lock.
+
+class Counter {
+ public:
+  void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+ public:
+  void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+  void add(int64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  void sub(int64_t n = 1) { value_.fetch_sub(n, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Fixed-bucket histogram of millisecond values. The sum is kept in
+// microseconds so it can live in an integer atomic.
+class Histogram {
+ public:
+  explicit Histogram(std::vector<double> bounds)
+      : bounds_(std::move(bounds)),
+        buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    for (size_t i = 0; i <= bounds_.size(); i++) {
+      buckets_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void observe(double ms) {
+    size_t i = 0;
+    while (i < bounds_.size() && ms > bounds_[i]) {
+      i++;
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(static_cast<uint64_t>(std::llround(ms * 1000.0)),
+                      std::memory_order_relaxed);
+  }
+
+  const std::vector<double> &bounds() const { return bounds_; }
+  uint64_t bucket(size_t i) const {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  double sum() const {
+    return sum_us_.load(std::memory_order_relaxed) / 1000.0;
+  }
+
+ private:
+  const std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_us_{0};
+};
+
+class MetricsRegistry {
+ public:
+  Counter &counter(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_.emplace_back();
+    entries_.push_back({name, help, &counters_.back(), nullptr, nullptr, {}});
+    return counters_.back();
+  }
+
+  Gauge &gauge(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gauges_.emplace_back();
+    entries_.push_back({name, help, nullptr, &gauges_.back(), nullptr, {}});
+    return gauges_.back();
+  }
+
+  // Gauge whose value is sampled when /metrics is scraped.
+  void gauge(const std::string &name, const std::string &help,
+             std::function<double()> sample) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_back(
+        {name, help, nullptr, nullptr, nullptr, std::move(sample)});
+  }
+
+  Histogram &histogram(const std::string &name, const std::string &help,
+                       std::vector<double> bounds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    histograms_.emplace_back(std::move(bounds));
+    entries_.push_back(
+        {name, help, nullptr, nullptr, &histograms_.back(), {}});
+    return histograms_.back();
+  }
+
+  // Prometheus text exposition format, version 0.0.4.
+  std::string render() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    for (const auto &entry : entries_) {
+      out << "# HELP " << entry.name << " " << entry.help << "\n";
+      if (entry.counter) {
+        out << "# TYPE " << entry.name << " counter\n";
+        out << entry.name << " " << entry.counter->value() << "\n";
+      } else if (entry.gauge) {
+        out << "# TYPE " << entry.name << " gauge\n";
+        out << entry.name << " " << entry.gauge->value() << "\n";
+      } else if (entry.histogram) {
+        const Histogram &h = *entry.histogram;
+        out << "# TYPE " << entry.name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < h.bounds().size(); i++) {
+          cumulative += h.bucket(i);
+          out << entry.name << "_bucket{le=\"" << h.bounds()[i] << "\"} "
+              << cumulative << "\n";
+        }
+        cumulative += h.bucket(h.bounds().size());
+        out << entry.name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        out << entry.name << "_sum " << h.sum() << "\n";
+        out << entry.name << "_count " << h.count() << "\n";
+      } else {
+        out << "# TYPE " << entry.name << " gauge\n";
+        out << entry.name << " " << entry.sample() << "\n";
+      }
+    }
+    return out.str();
+  }
+
+ private:
+  struct Entry {
+    std::string name;
+    std::string help;
+    Counter *counter;
+    Gauge *gauge;
+    Histogram *histogram;
+    std::function<double()> sample;
+  };
+
+  mutable std::mutex mutex_;
+  // deques keep references stable as metrics are added
+  std::deque<Counter> counters_;
+  std::deque<Gauge> gauges_;
+  std::deque<Histogram> histograms_;
+  std::vector<Entry> entries_;
+};
+
+template <typename TimePoint>
+inline double elapsedMs(TimePoint start, TimePoint end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Bucket bounds in milliseconds shared by the pipeline stage histograms.
+inline std::vector<double> latencyBucketsMs() {
+  return {1,   2.5,  5,    10,   25,    50,    100,  250,
+          500, 1000, 2500, 5000, 10000, 30000, 60000};
+}
+
+#endif  // METRICS_HPP
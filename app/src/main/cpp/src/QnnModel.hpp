@@ -4,16 +4,20 @@
 #include <HTP/QnnHtpDevice.h>
 #include <inttypes.h>
 
-#include <Config.hpp>
 #include <QnnSampleApp.hpp>
 #include <QnnTypeMacros.hpp>
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <utility>
+#include <vector>
 
 #include "DataUtil.hpp"
+#include "GenerationContext.hpp"
 #include "Logger.hpp"
 #include "SDUtils.hpp"
+#include "Trace.hpp"
 
 using namespace qnn::tools::sample_app;
 
@@ -36,6 +40,15 @@ class QnnModel : public QnnSampleApp {
                      inputDataType, profilingLevel, dumpOutputs,
                      cachedBinaryPath, saveBinaryName) {}
 
+  ~QnnModel() {
+    for (auto &tensors : m_unetTensorPool) {
+      auto graphInfo = (*m_graphsInfo)[0];
+      m_ioTensor.tearDownInputAndOutputTensors(
+          tensors.first, tensors.second, graphInfo.numInputTensors,
+          graphInfo.numOutputTensors);
+    }
+  }
+
   StatusCode enablePerformaceMode() {
     uint32_t powerConfigId;
     uint32_t deviceId = 0;
@@ -134,7 +147,10 @@ class QnnModel : public QnnSampleApp {
     return StatusCode::SUCCESS;
   }
 
-  StatusCode executeClipGraphs(int32_t *input_ids, float *text_embedding) {
+  // Encodes the ctx.batchSize() prompts of 77 ids each in input_ids into
+  // ctx.unet_input.text_embedding, one graph execution per prompt.
+  StatusCode executeClipGraphs(GenerationContext &ctx,
+                               const std::vector<int> &input_ids) {
     auto returnStatus = StatusCode::SUCCESS;
 
     size_t graphIdx = 0;
@@ -163,62 +179,94 @@ class QnnModel : public QnnSampleApp {
       returnStatus = StatusCode::FAILURE;
       return returnStatus;
     }
-
-    // input_ids
-    {
-      uint32_t elementCount = 1 * 77;
-      memcpy(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data, input_ids,
-             elementCount * sizeof(int32_t));
+    if (input_ids.size() != ctx.batchSize() * 77) {
+      QNN_ERROR("Expecting %d input ids, got %d", ctx.batchSize() * 77,
+                static_cast<int>(input_ids.size()));
+      returnStatus = StatusCode::FAILURE;
+      return returnStatus;
     }
 
-    // execute graph
-    QNN_DEBUG("Executing clip graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("clip graph execution time: %d ms", duration);
+    for (int batch = 0; batch < ctx.batchSize(); batch++) {
+      // input_ids
+      {
+        int32_t *input_ids_int32 =
+            static_cast<int32_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
+        std::copy_n(input_ids.begin() + batch * 77, 77, input_ids_int32);
+      }
 
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("clip graph execution failed!");
-    }
+      // execute graph
+      QNN_DEBUG("Executing clip graph: %d", graphIdx);
+      Qnn_ErrorHandle_t executeStatus;
+      {
+        TraceSpan span("clip.graphExecute");
+        executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
+            graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
+            graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
+      }
 
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      float *tmp = nullptr;
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
+      if (QNN_GRAPH_NO_ERROR != executeStatus) {
+        QNN_ERROR("clip graph execution failed!");
         returnStatus = StatusCode::FAILURE;
         return returnStatus;
       }
 
-      uint32_t elementCount = 1 * 77 * text_embedding_size;
-      memcpy(text_embedding, tmp, elementCount * sizeof(float));
-      free(tmp);
+      // get output
+      {
+        float *tmp = nullptr;
+        TraceSpan span("convertToFloat");
+        if (qnn::tools::iotensor::StatusCode::SUCCESS !=
+            m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
+          returnStatus = StatusCode::FAILURE;
+          return returnStatus;
+        }
+
+        int elementCount = ctx.embeddingSize();
+        memcpy(ctx.unet_input.text_embedding.data() + batch * elementCount,
+               tmp, elementCount * sizeof(float));
+        free(tmp);
+      }
     }
 
     return returnStatus;
   }
 
-  StatusCode executeUnetGraphs(float *latents, int timestep,
-                               float *text_embedding, float *latents_pred) {
+  // Element count of the UNet graph's timestep_cond input (the guidance
+  // scale embedding of LCM-distilled models), 0 if it has none.
+  size_t unetTimestepCondSize() {
+    auto graphInfo = (*m_graphsInfo)[0];
+    if (graphInfo.numInputTensors < 4) {
+      return 0;
+    }
+    const Qnn_Tensor_t &tensor = graphInfo.inputTensors[3];
+    size_t elementCount = 1;
+    for (uint32_t i = 0; i < QNN_TENSOR_GET_RANK(tensor); i++) {
+      elementCount *= QNN_TENSOR_GET_DIMENSIONS(tensor)[i];
+    }
+    return elementCount;
+  }
+
+  // Predicts the noise of ctx.unet_input into ctx.unet_output. The graph
+  // takes a batch of 1, so with CFG it runs once per half. The IO tensors
+  // are the job's own (ctx.unet_inputs/unet_outputs), taken from the pool on
+  // first use and handed back by releaseUnetTensors().
+  StatusCode executeUnetGraphs(GenerationContext &ctx) {
     auto returnStatus = StatusCode::SUCCESS;
 
     size_t graphIdx = 0;
     QNN_DEBUG("Starting unet execution for graphIdx: %d", graphIdx);
 
     // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
+    if ((ctx.unet_inputs == nullptr || ctx.unet_outputs == nullptr) &&
+        !m_unetTensorPool.empty()) {
+      ctx.unet_inputs = m_unetTensorPool.back().first;
+      ctx.unet_outputs = m_unetTensorPool.back().second;
+      m_unetTensorPool.pop_back();
+    }
+    if (ctx.unet_inputs == nullptr || ctx.unet_outputs == nullptr) {
       if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
+          m_ioTensor.setupInputAndOutputTensors(
+              &ctx.unet_inputs, &ctx.unet_outputs,
+              (*m_graphsInfo)[graphIdx])) {
         QNN_ERROR(
             "Error in setting up Input and output Tensors for graphIdx: %d",
             graphIdx);
@@ -227,80 +275,118 @@ class QnnModel : public QnnSampleApp {
       }
     }
     auto graphInfo = (*m_graphsInfo)[graphIdx];
+    Qnn_Tensor_t *unetInputs = ctx.unet_inputs;
+    Qnn_Tensor_t *unetOutputs = ctx.unet_outputs;
 
-    if (graphInfo.numInputTensors != 3) {
-      QNN_ERROR("Expecting 3 input tensors, got %d", graphInfo.numInputTensors);
+    if (graphInfo.numInputTensors != 3 && graphInfo.numInputTensors != 4) {
+      QNN_ERROR("Expecting 3 or 4 input tensors, got %d",
+                graphInfo.numInputTensors);
       returnStatus = StatusCode::FAILURE;
       return returnStatus;
     }
-
-    // latents
-    {
-      uint16_t *latents_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 4 * sample_size * sample_size;
-      qnn::tools::datautil::floatToTfN(
-          latents_uint16, latents,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
-
-    // position/timestep
-    {
-      int32_t *positionData =
-          static_cast<int32_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[1]).data);
-      positionData[0] = timestep;
+    bool hasTimestepCond = graphInfo.numInputTensors == 4;
+    if (hasTimestepCond && ctx.unet_input.timestep_cond.empty()) {
+      QNN_ERROR("unet graph expects timestep_cond, none given");
+      returnStatus = StatusCode::FAILURE;
+      return returnStatus;
     }
 
-    // text_embedding
-    {
-      uint16_t *text_embedding_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[2]).data);
-      int elementCount = 1 * 77 * text_embedding_size;
-      qnn::tools::datautil::floatToTfN(
-          text_embedding_uint16, text_embedding,
-          inputs[2].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[2].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
+    for (int batch = 0; batch < ctx.batchSize(); batch++) {
+      // latents
+      {
+        uint16_t *latents_uint16 = static_cast<uint16_t *>(
+            QNN_TENSOR_GET_CLIENT_BUF(unetInputs[0]).data);
+        int elementCount = ctx.latentSize();
+        TraceSpan span("floatToTfN");
+        qnn::tools::datautil::floatToTfN(
+            latents_uint16,
+            ctx.unet_input.latents.data() + batch * elementCount,
+            unetInputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
+            unetInputs[0].v1.quantizeParams.scaleOffsetEncoding.scale,
+            elementCount);
+      }
 
-    // execute graph
-    QNN_DEBUG("Executing unet graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
+      // position/timestep
+      {
+        int32_t *positionData = static_cast<int32_t *>(
+            QNN_TENSOR_GET_CLIENT_BUF(unetInputs[1]).data);
+        positionData[0] = ctx.unet_input.timestep;
+      }
 
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
+      // text_embedding
+      {
+        uint16_t *text_embedding_uint16 = static_cast<uint16_t *>(
+            QNN_TENSOR_GET_CLIENT_BUF(unetInputs[2]).data);
+        int elementCount = ctx.embeddingSize();
+        TraceSpan span("floatToTfN");
+        qnn::tools::datautil::floatToTfN(
+            text_embedding_uint16,
+            ctx.unet_input.text_embedding.data() + batch * elementCount,
+            unetInputs[2].v1.quantizeParams.scaleOffsetEncoding.offset,
+            unetInputs[2].v1.quantizeParams.scaleOffsetEncoding.scale,
+            elementCount);
+      }
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("unet graph execution time: %d ms", duration);
+      // timestep_cond, the same for both CFG halves
+      if (hasTimestepCond && batch == 0) {
+        uint16_t *timestep_cond_uint16 = static_cast<uint16_t *>(
+            QNN_TENSOR_GET_CLIENT_BUF(unetInputs[3]).data);
+        qnn::tools::datautil::floatToTfN(
+            timestep_cond_uint16, ctx.unet_input.timestep_cond.data(),
+            unetInputs[3].v1.quantizeParams.scaleOffsetEncoding.offset,
+            unetInputs[3].v1.quantizeParams.scaleOffsetEncoding.scale,
+            ctx.unet_input.timestep_cond.size());
+      }
 
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("unet graph execution failed!");
-    }
+      // execute graph
+      QNN_DEBUG("Executing unet graph: %d", graphIdx);
+      Qnn_ErrorHandle_t executeStatus;
+      {
+        TraceSpan span("unet.graphExecute");
+        executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
+            graphInfo.graph, unetInputs, graphInfo.numInputTensors,
+            unetOutputs, graphInfo.numOutputTensors, m_profileBackendHandle,
+            nullptr);
+      }
 
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      float *tmp = nullptr;
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
+      if (QNN_GRAPH_NO_ERROR != executeStatus) {
+        QNN_ERROR("unet graph execution failed!");
         returnStatus = StatusCode::FAILURE;
         return returnStatus;
       }
 
-      int elementCount = 1 * 4 * sample_size * sample_size;
-      memcpy(latents_pred, tmp, elementCount * sizeof(float));
-      free(tmp);
+      // get output, dequantized straight into the job's buffer
+      {
+        TraceSpan span("tfNToFloat");
+        int elementCount = ctx.latentSize();
+        if (!tensorToFloat(unetOutputs[0],
+                           ctx.unet_output.latents.data() + batch * elementCount,
+                           elementCount)) {
+          QNN_ERROR("unsupported unet output tensor");
+          returnStatus = StatusCode::FAILURE;
+          return returnStatus;
+        }
+      }
     }
 
     return returnStatus;
   }
 
-  StatusCode executeVaeEncoderGraphs(float *pixel_values, float *mean,
-                                     float *std) {
+  // Returns the job's UNet IO tensors to the pool so the next image or job
+  // on this graph skips the setup; they are freed with the model.
+  void releaseUnetTensors(GenerationContext &ctx) {
+    if (ctx.unet_inputs == nullptr && ctx.unet_outputs == nullptr) {
+      return;
+    }
+    m_unetTensorPool.emplace_back(ctx.unet_inputs, ctx.unet_outputs);
+    ctx.unet_inputs = nullptr;
+    ctx.unet_outputs = nullptr;
+  }
+
+  // Encodes the ctx.imageSize() floats of pixel_values into
+  // ctx.vae_encoder_output.
+  StatusCode executeVaeEncoderGraphs(GenerationContext &ctx,
+                                     float *pixel_values) {
     auto returnStatus = StatusCode::SUCCESS;
 
     size_t graphIdx = 0;
@@ -330,7 +416,8 @@ class QnnModel : public QnnSampleApp {
     {
       uint16_t *pixel_values_uint16 =
           static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 3 * output_size * output_size;
+      int elementCount = ctx.imageSize();
+      TraceSpan span("floatToTfN");
       qnn::tools::datautil::floatToTfN(
           pixel_values_uint16, pixel_values,
           inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
@@ -339,17 +426,13 @@ class QnnModel : public QnnSampleApp {
 
     // execute graph
     QNN_DEBUG("Executing vae encoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("vae encoder graph execution time: %d ms", duration);
+    Qnn_ErrorHandle_t executeStatus;
+    {
+      TraceSpan span("vae_encoder.graphExecute");
+      executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
+          graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
+          graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
+    }
 
     if (QNN_GRAPH_NO_ERROR != executeStatus) {
       returnStatus = StatusCode::FAILURE;
@@ -358,33 +441,41 @@ class QnnModel : public QnnSampleApp {
 
     // get output
     if (StatusCode::SUCCESS == returnStatus) {
+      int elementCount = ctx.latentSize();
+      ctx.vae_encoder_output.mean.resize(elementCount);
+      ctx.vae_encoder_output.std.resize(elementCount);
       {
         float *tmp = nullptr;
-        int elementCount = 1 * 4 * sample_size * sample_size;
+        TraceSpan span("convertToFloat");
         if (qnn::tools::iotensor::StatusCode::SUCCESS !=
             m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
           returnStatus = StatusCode::FAILURE;
           return returnStatus;
         }
-        memcpy(mean, tmp, elementCount * sizeof(float));
+        memcpy(ctx.vae_encoder_output.mean.data(), tmp,
+               elementCount * sizeof(float));
         free(tmp);
       }
       {
         float *tmp = nullptr;
-        int elementCount = 1 * 4 * sample_size * sample_size;
+        TraceSpan span("convertToFloat");
         if (qnn::tools::iotensor::StatusCode::SUCCESS !=
             m_ioTensor.convertToFloat(&tmp, &outputs[1])) {
           returnStatus = StatusCode::FAILURE;
           return returnStatus;
         }
-        memcpy(std, tmp, elementCount * sizeof(float));
+        memcpy(ctx.vae_encoder_output.std.data(), tmp,
+               elementCount * sizeof(float));
         free(tmp);
       }
     }
     return returnStatus;
   }
 
-  StatusCode executeVaeDecoderGraphs(float *latents, float *pixel_values) {
+  // Decodes ctx.latentSize() floats of latents into ctx.imageSize() floats
+  // of pixel_values.
+  StatusCode executeVaeDecoderGraphs(const GenerationContext &ctx,
+                                     float *latents, float *pixel_values) {
     auto returnStatus = StatusCode::SUCCESS;
 
     size_t graphIdx = 0;
@@ -414,7 +505,8 @@ class QnnModel : public QnnSampleApp {
     {
       uint16_t *latents_uint16 =
           static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 4 * sample_size * sample_size;
+      int elementCount = ctx.latentSize();
+      TraceSpan span("floatToTfN");
       qnn::tools::datautil::floatToTfN(
           latents_uint16, latents,
           inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
@@ -423,17 +515,13 @@ class QnnModel : public QnnSampleApp {
 
     // execute graph
     QNN_DEBUG("Executing vae decoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("vae decoder graph execution time: %d ms", duration);
+    Qnn_ErrorHandle_t executeStatus;
+    {
+      TraceSpan span("vae_decoder.graphExecute");
+      executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
+          graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
+          graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
+    }
 
     if (QNN_GRAPH_NO_ERROR != executeStatus) {
       returnStatus = StatusCode::FAILURE;
@@ -443,7 +531,8 @@ class QnnModel : public QnnSampleApp {
     // get output
     if (StatusCode::SUCCESS == returnStatus) {
       float *tmp = nullptr;
-      int elementCount = 1 * 3 * output_size * output_size;
+      int elementCount = ctx.imageSize();
+      TraceSpan span("convertToFloat");
       if (qnn::tools::iotensor::StatusCode::SUCCESS !=
           m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
         returnStatus = StatusCode::FAILURE;
@@ -454,6 +543,47 @@ class QnnModel : public QnnSampleApp {
     }
     return returnStatus;
   }
+
+ private:
+  // Dequantizes count elements of tensor into out. Unlike
+  // IOTensor::convertToFloat() it writes to the caller's buffer instead of
+  // a freshly malloc'ed one, so the UNet step loop does not allocate.
+  static bool tensorToFloat(const Qnn_Tensor_t &tensor, float *out,
+                            size_t count) {
+    const Qnn_ClientBuffer_t &buffer = QNN_TENSOR_GET_CLIENT_BUF(tensor);
+    int32_t offset = tensor.v1.quantizeParams.scaleOffsetEncoding.offset;
+    float scale = tensor.v1.quantizeParams.scaleOffsetEncoding.scale;
+    switch (QNN_TENSOR_GET_DATA_TYPE(tensor)) {
+      case QNN_DATATYPE_UFIXED_POINT_16:
+        if (buffer.dataSize < count * sizeof(uint16_t)) {
+          return false;
+        }
+        return qnn::tools::datautil::StatusCode::SUCCESS ==
+               qnn::tools::datautil::tfNToFloat<uint16_t>(
+                   out, static_cast<uint16_t *>(buffer.data), offset, scale,
+                   count);
+      case QNN_DATATYPE_UFIXED_POINT_8:
+        if (buffer.dataSize < count * sizeof(uint8_t)) {
+          return false;
+        }
+        return qnn::tools::datautil::StatusCode::SUCCESS ==
+               qnn::tools::datautil::tfNToFloat<uint8_t>(
+                   out, static_cast<uint8_t *>(buffer.data), offset, scale,
+                   count);
+      case QNN_DATATYPE_FLOAT_32:
+        if (buffer.dataSize < count * sizeof(float)) {
+          return false;
+        }
+        memcpy(out, buffer.data, count * sizeof(float));
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // UNet IO tensor sets not held by a job, at most one per job that has run
+  // on this graph concurrently.
+  std::vector<std::pair<Qnn_Tensor_t *, Qnn_Tensor_t *>> m_unetTensorPool;
 };
 
-#endif  // QNNMODEL_HPP
\ No newline at end of file
+#endif  // QNNMODEL_HPP
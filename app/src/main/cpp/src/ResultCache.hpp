@@ -0,0 +1,274 @@
+#ifndef RESULTCACHE_HPP
+#define RESULTCACHE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include "ResultStore.hpp"
+
+// Incremental 128-bit FNV-1a (two independent 64-bit lanes). Used to turn a
+// canonical request description into a fixed-size cache key.
+class RequestHasher {
+ public:
+  RequestHasher &add(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+      lo_ = (lo_ ^ bytes[i]) * 0x100000001b3ULL;
+      hi_ = (hi_ ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return *this;
+  }
+
+  // Length-prefixed so that adjacent fields cannot run into each other.
+  RequestHasher &add(const std::string &field) {
+    uint64_t size = field.size();
+    add(&size, sizeof(size));
+    return add(field.data(), field.size());
+  }
+
+  std::string hex() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+             static_cast<unsigned long long>(hi_),
+             static_cast<unsigned long long>(lo_));
+    return buf;
+  }
+
+ private:
+  uint64_t lo_ = 0xcbf29ce484222325ULL;
+  uint64_t hi_ = 0x84222325cbf29ce4ULL;
+};
+
+// "path:size:mtime" for every model file, so rebuilt or replaced binaries
+// never serve results of the old ones.
+inline std::string modelFileIdentity(const std::vector<std::string> &paths) {
+  std::string identity;
+  for (const auto &path : paths) {
+    if (path.empty()) {
+      continue;
+    }
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    identity += path + ":" + std::to_string(ec ? 0 : size) + ":" +
+                std::to_string(ec ? 0 : mtime.time_since_epoch().count()) +
+                ";";
+  }
+  return identity;
+}
+
+// Content-addressed cache of finished, encoded images. Entries live in
+// memory under an LRU byte budget; with a spill directory, entries evicted
+// from memory are written to disk (under their own byte budget) and
+// promoted back on the next hit.
+class ResultCache {
+ public:
+  ResultCache(size_t max_bytes, std::string spill_dir, size_t max_disk_bytes)
+      : max_bytes_(max_bytes),
+        spill_dir_(std::move(spill_dir)),
+        max_disk_bytes_(max_disk_bytes) {
+    if (!spill_dir_.empty()) {
+      loadSpillDir();
+    }
+  }
+
+  std::shared_ptr<const StoredImage> get(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      hits_++;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->second;
+    }
+    auto image = readSpilled(key);
+    if (!image) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    insert(key, image);
+    return image;
+  }
+
+  void put(const std::string &key, std::shared_ptr<const StoredImage> image) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.count(key)) {
+      return;
+    }
+    insert(key, std::move(image));
+  }
+
+  uint64_t hits() const { return hits_.load(); }
+  uint64_t misses() const { return misses_.load(); }
+
+  size_t entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  size_t disk_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return disk_bytes_;
+  }
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const StoredImage>>;
+
+  static size_t sizeOf(const StoredImage &image) {
+    return image.data.size() + image.content_type.size();
+  }
+
+  void insert(const std::string &key, std::shared_ptr<const StoredImage> image) {
+    size_t size = sizeOf(*image);
+    if (size > max_bytes_) {
+      spill(key, *image);
+      return;
+    }
+    entries_.emplace_front(key, std::move(image));
+    index_[key] = entries_.begin();
+    bytes_ += size;
+    while (bytes_ > max_bytes_) {
+      auto &last = entries_.back();
+      bytes_ -= sizeOf(*last.second);
+      spill(last.first, *last.second);
+      index_.erase(last.first);
+      entries_.pop_back();
+    }
+  }
+
+  std::string spillPath(const std::string &key) const {
+    return spill_dir_ + "/" + key + ".img";
+  }
+
+  // File layout: width, height, channels, content type length (int32 each),
+  // content type, pixel/encoded bytes.
+  void spill(const std::string &key, const StoredImage &image) {
+    if (spill_dir_.empty() || disk_index_.count(key)) {
+      return;
+    }
+    std::string path = spillPath(key);
+    std::string tmp = path + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      int32_t header[4] = {image.width, image.height, image.channels,
+                           static_cast<int32_t>(image.content_type.size())};
+      out.write(reinterpret_cast<const char *>(header), sizeof(header));
+      out.write(image.content_type.data(), image.content_type.size());
+      out.write(reinterpret_cast<const char *>(image.data.data()),
+                image.data.size());
+      if (!out) {
+        std::remove(tmp.c_str());
+        return;
+      }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return;
+    }
+    addSpilled(key, sizeOf(image) + 4 * sizeof(int32_t));
+  }
+
+  void addSpilled(const std::string &key, size_t size) {
+    disk_entries_.emplace_front(key, size);
+    disk_index_[key] = disk_entries_.begin();
+    disk_bytes_ += size;
+    while (disk_bytes_ > max_disk_bytes_ && !disk_entries_.empty()) {
+      auto &last = disk_entries_.back();
+      std::remove(spillPath(last.first).c_str());
+      disk_bytes_ -= last.second;
+      disk_index_.erase(last.first);
+      disk_entries_.pop_back();
+    }
+  }
+
+  // Moves a spilled entry back into memory; the file is dropped since the
+  // entry will be spilled again if it is evicted.
+  std::shared_ptr<const StoredImage> readSpilled(const std::string &key) {
+    auto it = disk_index_.find(key);
+    if (it == disk_index_.end()) {
+      return nullptr;
+    }
+    std::string path = spillPath(key);
+    auto image = std::make_shared<StoredImage>();
+    bool ok = false;
+    {
+      std::ifstream in(path, std::ios::binary);
+      int32_t header[4];
+      if (in.read(reinterpret_cast<char *>(header), sizeof(header)) &&
+          header[3] >= 0 &&
+          sizeof(header) + header[3] <= it->second->second) {
+        image->width = header[0];
+        image->height = header[1];
+        image->channels = header[2];
+        image->content_type.resize(header[3]);
+        size_t data_size = it->second->second - sizeof(header) - header[3];
+        image->data.resize(data_size);
+        ok = in.read(&image->content_type[0], header[3]) &&
+             in.read(reinterpret_cast<char *>(image->data.data()), data_size);
+      }
+    }
+    std::remove(path.c_str());
+    disk_bytes_ -= it->second->second;
+    disk_entries_.erase(it->second);
+    disk_index_.erase(it);
+    return ok ? image : nullptr;
+  }
+
+  // Picks up entries spilled by a previous run, oldest first, so the disk
+  // budget holds across restarts.
+  void loadSpillDir() {
+    std::error_code ec;
+    std::filesystem::create_directories(spill_dir_, ec);
+    std::vector<std::pair<std::filesystem::file_time_type,
+                          std::filesystem::path>>
+        files;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(spill_dir_, ec)) {
+      if (entry.path().extension() == ".img") {
+        files.emplace_back(entry.last_write_time(ec), entry.path());
+      } else if (entry.path().extension() == ".tmp") {
+        std::filesystem::remove(entry.path(), ec);
+      }
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto &file : files) {
+      size_t size = std::filesystem::file_size(file.second, ec);
+      if (!ec) {
+        addSpilled(file.second.stem().string(), size);
+      }
+    }
+  }
+
+  const size_t max_bytes_;
+  const std::string spill_dir_;
+  const size_t max_disk_bytes_;
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+  std::list<std::pair<std::string, size_t>> disk_entries_;
+  std::unordered_map<std::string,
+                     std::list<std::pair<std::string, size_t>>::iterator>
+      disk_index_;
+  size_t disk_bytes_ = 0;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+#endif  // RESULTCACHE_HPP
@@ -0,0 +1,66 @@
+#ifndef RESULTSTORE_HPP
+#define RESULTSTORE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct StoredImage {
+  std::vector<uint8_t> data;
+  std::string content_type;
+  int width;
+  int height;
+  int channels;
+};
+
+// Bounded in-memory store of finished images, served by GET /result/{id}.
+// Entries are shared so a response can stream one while it gets evicted.
+class ResultStore {
+ public:
+  explicit ResultStore(size_t max_entries)
+      : max_entries_(max_entries), rng_(std::random_device{}()) {}
+
+  std::string put(std::shared_ptr<const StoredImage> image) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string id = next_id();
+    order_.push_back(id);
+    entries_[id] = std::move(image);
+    while (entries_.size() > max_entries_) {
+      entries_.erase(order_.front());
+      order_.pop_front();
+    }
+    return id;
+  }
+
+  std::shared_ptr<const StoredImage> get(const std::string &id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+    return it->second;
+  }
+
+ private:
+  std::string next_id() {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx",
+             static_cast<unsigned long long>(rng_()));
+    return buf;
+  }
+
+  const size_t max_entries_;
+  mutable std::mutex mutex_;
+  std::mt19937_64 rng_;
+  std::list<std::string> order_;
+  std::unordered_map<std::string, std::shared_ptr<const StoredImage>>
+      entries_;
+};
+
+#endif  // RESULTSTORE_HPP
@@ -230,11 +230,11 @@ bool safety_check(const std::vector<uint8_t> &image_data, int width, int height,
   }
 }
 
-void decode_image(const std::vector<uint8_t> &image_binary,
+void decode_image(const uint8_t *image_binary, size_t image_size,
                   std::vector<uint8_t> &output_pixels, int output_size) {
   int width, height, channels;
   uint8_t *decoded_data =
-      stbi_load_from_memory(image_binary.data(), image_binary.size(), &width,
+      stbi_load_from_memory(image_binary, static_cast<int>(image_size), &width,
                             &height, &channels, 3);  // Force 3 channels (RGB)
 
   if (!decoded_data) {
@@ -287,6 +287,12 @@ void decode_image(const std::vector<uint8_t> &image_binary,
   }
 }
 
+void decode_image(const std::vector<uint8_t> &image_binary,
+                  std::vector<uint8_t> &output_pixels, int output_size) {
+  decode_image(image_binary.data(), image_binary.size(), output_pixels,
+               output_size);
+}
+
 void gaussianBlur(std::vector<uint8_t> &imageData, int width, int height,
                   int radius) {
   if (width <= 0 || height <= 0 || radius <= 0 || imageData.empty()) {
@@ -346,6 +352,49 @@ void gaussianBlur(std::vector<uint8_t> &imageData, int width, int height,
   }
 }
 
+// Cheap approximation of the VAE: projects each latent pixel to RGB with a
+// fixed linear map (SD 1.x/2.x latent space), upsamples and JPEG-encodes it.
+inline bool latent_preview_jpeg(const float *latents, int latent_height,
+                                int latent_width, int preview_size,
+                                int quality, std::vector<uint8_t> &jpeg) {
+  static const float latent_rgb_factors[4][3] = {
+      {0.3512f, 0.2297f, 0.3227f},
+      {0.3250f, 0.4974f, 0.2350f},
+      {-0.2829f, 0.1762f, 0.2721f},
+      {-0.2120f, -0.2616f, -0.7177f},
+  };
+  static const float latent_rgb_bias[3] = {0.0f, 0.0f, 0.0f};
+
+  int plane = latent_height * latent_width;
+  std::vector<uint8_t> rgb(plane * 3);
+  for (int i = 0; i < plane; i++) {
+    for (int c = 0; c < 3; c++) {
+      float v = latent_rgb_bias[c];
+      for (int k = 0; k < 4; k++) {
+        v += latents[k * plane + i] * latent_rgb_factors[k][c];
+      }
+      v = (v + 1.0f) * 127.5f;
+      rgb[i * 3 + c] = static_cast<uint8_t>(std::clamp(v, 0.0f, 255.0f));
+    }
+  }
+
+  std::vector<uint8_t> upsampled(preview_size * preview_size * 3);
+  if (!stbir_resize_uint8_linear(rgb.data(), latent_width, latent_height, 0,
+                                 upsampled.data(), preview_size, preview_size,
+                                 0, STBIR_RGB)) {
+    return false;
+  }
+  jpeg.clear();
+  return stbi_write_jpg_to_func(
+             [](void *context, void *data, int size) {
+               auto &buffer = *static_cast<std::vector<uint8_t> *>(context);
+               buffer.insert(buffer.end(), static_cast<uint8_t *>(data),
+                             static_cast<uint8_t *>(data) + size);
+             },
+             &jpeg, preview_size, preview_size, 3, upsampled.data(),
+             quality) != 0;
+}
+
 inline void PrintEncodeResult(const std::vector<int> &ids) {
   std::cout << "tokens=[";
   for (size_t i = 0; i < ids.size(); ++i) {
@@ -0,0 +1,75 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <cstddef>
+#include <string>
+#include <xtensor/xarray.hpp>
+
+enum class SchedulerType {
+  DPM_SOLVER,  // DPMSolverMultistepScheduler
+  UNIPC,       // UniPCMultistepScheduler
+  LCM,         // LCMScheduler, for LCM-distilled UNets
+};
+
+inline bool parseSchedulerType(const std::string &name, SchedulerType &type) {
+  if (name == "dpm_solver") {
+    type = SchedulerType::DPM_SOLVER;
+  } else if (name == "unipc") {
+    type = SchedulerType::UNIPC;
+  } else if (name == "lcm") {
+    type = SchedulerType::LCM;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char *schedulerTypeName(SchedulerType type) {
+  switch (type) {
+    case SchedulerType::UNIPC:
+      return "unipc";
+    case SchedulerType::LCM:
+      return "lcm";
+    default:
+      return "dpm_solver";
+  }
+}
+
+// The part of a diffusers-style scheduler the denoising loop drives. One
+// instance serves one image: set_timesteps() once, then step() per UNet
+// evaluation.
+class Scheduler {
+ public:
+  struct SchedulerOutput {
+    xt::xarray<float> prev_sample;
+  };
+
+  virtual ~Scheduler() = default;
+
+  virtual void set_timesteps(int num_inference_steps) = 0;
+  virtual const xt::xarray<float> &get_timesteps() const = 0;
+  virtual void set_begin_index(int begin_index) = 0;
+  virtual xt::xarray<float> add_noise(
+      const xt::xarray<float> &original_samples,
+      const xt::xarray<float> &noise,
+      const xt::xarray<int> &timesteps) const = 0;
+
+  // Seeds the noise a stochastic scheduler adds in step(). Called with the
+  // image's seed before its first step; deterministic schedulers ignore it.
+  virtual void seed(unsigned) {}
+
+  // Sizes the scheduler's buffers for samples of n floats, so that step()
+  // does not allocate.
+  virtual void reserve(size_t n) = 0;
+
+  // Combines the UNet output halves with classifier-free guidance
+  // (noise_pred_text is nullptr without CFG), advances the n floats of
+  // sample in place and writes the new sample to the num_copies buffers in
+  // copies as well.
+  virtual void step(const float *noise_pred_uncond,
+                    const float *noise_pred_text, float guidance_scale,
+                    int timestep, float *sample, size_t n,
+                    float *const *copies, int num_copies) = 0;
+};
+
+#endif  // SCHEDULER_HPP
@@ -0,0 +1,90 @@
+#ifndef STEPSCHEDULER_HPP
+#define STEPSCHEDULER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class SchedulePolicy {
+  FIFO,                // run the oldest job to completion first
+  ROUND_ROBIN,         // one step of every active job in turn
+  SHORTEST_REMAINING,  // the job with the fewest steps left
+};
+
+inline bool parseSchedulePolicy(const std::string &name,
+                                SchedulePolicy &policy) {
+  if (name == "fifo") {
+    policy = SchedulePolicy::FIFO;
+  } else if (name == "round_robin") {
+    policy = SchedulePolicy::ROUND_ROBIN;
+  } else if (name == "shortest_remaining") {
+    policy = SchedulePolicy::SHORTEST_REMAINING;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char *schedulePolicyName(SchedulePolicy policy) {
+  switch (policy) {
+    case SchedulePolicy::ROUND_ROBIN:
+      return "round_robin";
+    case SchedulePolicy::SHORTEST_REMAINING:
+      return "shortest_remaining";
+    default:
+      return "fifo";
+  }
+}
+
+// Decides which of the jobs the inference worker has taken on runs its next
+// step. Tasks are kept in admission order and must provide
+// remainingSteps(); ties go to the older task. Shortest-remaining can starve
+// a long job for as long as shorter ones keep arriving.
+template <typename Task>
+class StepScheduler {
+ public:
+  explicit StepScheduler(SchedulePolicy policy) : policy_(policy) {}
+
+  void add(Task task) { tasks_.push_back(std::move(task)); }
+
+  bool empty() const { return tasks_.empty(); }
+  size_t size() const { return tasks_.size(); }
+
+  Task &operator[](size_t index) { return tasks_[index]; }
+
+  // Index of the task to advance next. Requires !empty().
+  size_t pick() const {
+    switch (policy_) {
+      case SchedulePolicy::ROUND_ROBIN:
+        return cursor_ < tasks_.size() ? cursor_ : 0;
+      case SchedulePolicy::SHORTEST_REMAINING:
+        return std::min_element(tasks_.begin(), tasks_.end(),
+                                [](const Task &a, const Task &b) {
+                                  return a.remainingSteps() <
+                                         b.remainingSteps();
+                                }) -
+               tasks_.begin();
+      default:
+        return 0;
+    }
+  }
+
+  // Records that the task at index ran a step; a finished task is removed.
+  void ran(size_t index, bool finished) {
+    if (finished) {
+      tasks_.erase(tasks_.begin() + index);
+      cursor_ = index;
+    } else {
+      cursor_ = index + 1;
+    }
+  }
+
+ private:
+  const SchedulePolicy policy_;
+  std::vector<Task> tasks_;
+  size_t cursor_ = 0;
+};
+
+#endif  // STEPSCHEDULER_HPP
@@ -0,0 +1,151 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Span recorder that dumps Chrome trace-event JSON (chrome://tracing,
+// Perfetto). Every thread writes begin/end events into its own fixed-size
+// ring, so recording never contends with other threads. With tracing off a
+// span is a single relaxed load and branch.
+
+struct TraceEvent {
+  const char *name;  // must have static storage duration
+  uint64_t ts_ns;
+  int64_t arg;
+  uint32_t tid;
+  char phase;  // 'B' or 'E'
+};
+
+class TraceBuffer {
+ public:
+  static constexpr size_t kCapacity = 16384;
+
+  explicit TraceBuffer(uint32_t tid) : tid_(tid), events_(kCapacity) {}
+
+  void record(const char *name, char phase, int64_t arg) {
+    uint64_t ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    // Only contended while /debug/trace copies the ring out.
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_[next_ % kCapacity] = {name, ts, arg, tid_, phase};
+    next_++;
+  }
+
+  void collect(std::vector<TraceEvent> &out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = std::min<uint64_t>(next_, kCapacity);
+    for (uint64_t i = next_ - count; i < next_; i++) {
+      out.push_back(events_[i % kCapacity]);
+    }
+  }
+
+ private:
+  const uint32_t tid_;
+  mutable std::mutex mutex_;
+  std::vector<TraceEvent> events_;
+  uint64_t next_ = 0;
+};
+
+class Tracer {
+ public:
+  static Tracer &instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static void setEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  // Buffers are shared with the registry so events of exited threads can
+  // still be dumped.
+  TraceBuffer &threadBuffer() {
+    thread_local std::shared_ptr<TraceBuffer> buffer;
+    if (!buffer) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffer = std::make_shared<TraceBuffer>(
+          static_cast<uint32_t>(buffers_.size() + 1));
+      buffers_.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  // The most recent `last` events over all threads, oldest first.
+  std::string dumpChromeTrace(size_t last) const {
+    std::vector<TraceEvent> events;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto &buffer : buffers_) {
+        buffer->collect(events);
+      }
+    }
+    std::sort(events.begin(), events.end(),
+              [](const TraceEvent &a, const TraceEvent &b) {
+                return a.ts_ns < b.ts_ns;
+              });
+    size_t begin = events.size() > last ? events.size() - last : 0;
+
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (size_t i = begin; i < events.size(); i++) {
+      const TraceEvent &e = events[i];
+      if (i != begin) {
+        out << ",";
+      }
+      // Chrome expects microseconds; keep the nanosecond fraction.
+      out << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase
+          << "\",\"pid\":1,\"tid\":" << e.tid << ",\"ts\":" << e.ts_ns / 1000
+          << "." << std::to_string(1000 + e.ts_ns % 1000).substr(1);
+      if (e.phase == 'B' && e.arg >= 0) {
+        out << ",\"args\":{\"i\":" << e.arg << "}";
+      }
+      out << "}";
+    }
+    out << "]}";
+    return out.str();
+  }
+
+ private:
+  Tracer() = default;
+
+  static inline std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<TraceBuffer>> buffers_;
+};
+
+// Records a begin event on construction and the matching end event when the
+// scope exits, including by exception. arg (e.g. the step index) is shown
+// in the trace viewer when non-negative.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name, int64_t arg = -1)
+      : name_(Tracer::enabled() ? name : nullptr) {
+    if (name_) {
+      Tracer::instance().threadBuffer().record(name_, 'B', arg);
+    }
+  }
+
+  ~TraceSpan() {
+    if (name_) {
+      Tracer::instance().threadBuffer().record(name_, 'E', -1);
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+ private:
+  const char *name_;
+};
+
+#endif  // TRACE_HPP
@@ -0,0 +1,545 @@
+// self-implemented UniPCMultistepScheduler class, following diffusers with
+// predict_x0, the bh2 variant and a zero final sigma
+#ifndef UNIPCMULTISTEPSCHEDULER_HPP
+#define UNIPCMULTISTEPSCHEDULER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <xtensor/xarray.hpp>
+#include <xtensor/xmanipulation.hpp>
+#include <xtensor/xmath.hpp>
+#include <xtensor/xview.hpp>
+#include <xsimd/xsimd.hpp>
+
+#include "Scheduler.hpp"
+
+// Predictor-corrector multistep sampler (UniPC). Each step first corrects
+// the previous step's prediction with the model output just computed, then
+// predicts the next sample, so it reaches a given quality in fewer UNet
+// evaluations than DPM-Solver++.
+class UniPCMultistepScheduler : public Scheduler {
+ public:
+  UniPCMultistepScheduler(int num_train_timesteps, float beta_start,
+                          float beta_end, const std::string &beta_schedule,
+                          int solver_order, const std::string &prediction_type,
+                          const std::string &timestep_spacing)
+      : num_train_timesteps_(num_train_timesteps),
+        beta_start_(beta_start),
+        beta_end_(beta_end),
+        beta_schedule_(beta_schedule),
+        solver_order_(solver_order),
+        prediction_type_(prediction_type),
+        timestep_spacing_(timestep_spacing),
+        lower_order_final_(true) {
+    if (beta_schedule == "scaled_linear") {
+      float beta_start_sqrt = std::sqrt(beta_start_);
+      float beta_end_sqrt = std::sqrt(beta_end_);
+      betas_ = xt::pow(xt::linspace<float>(beta_start_sqrt, beta_end_sqrt,
+                                           num_train_timesteps),
+                       2.0f);
+    } else {
+      throw std::runtime_error(beta_schedule + " is not implemented");
+    }
+
+    alphas_ = 1.0f - betas_;
+    alphas_cumprod_ = xt::cumprod(alphas_);
+    sigmas_ = xt::pow((1.0f - alphas_cumprod_) / alphas_cumprod_, 0.5f);
+  }
+
+  void set_timesteps(int num_inference_steps) override {
+    num_inference_steps_ = num_inference_steps;
+
+    if (timestep_spacing_ == "leading") {
+      int step_ratio = num_train_timesteps_ / (num_inference_steps + 1);
+      xt::xarray<int> steps = xt::cast<int>(xt::round(
+          xt::arange<float>(0, num_inference_steps + 1) * float(step_ratio)));
+      timesteps_ = xt::view(xt::flip(steps, 0), xt::range(0, steps.size() - 1));
+    } else {
+      throw std::runtime_error(timestep_spacing_ + " is not supported");
+    }
+
+    xt::xarray<float> train_sigmas =
+        xt::pow((1.0f - alphas_cumprod_) / alphas_cumprod_, 0.5f);
+    sigmas_ = xt::zeros<float>({timesteps_.size() + 1});
+    for (size_t i = 0; i < timesteps_.size(); ++i) {
+      sigmas_(i) = train_sigmas(size_t(timesteps_(i)));
+    }
+
+    precompute_coefficients();
+
+    lower_order_nums_ = 0;
+    this_order_ = 0;
+    has_last_sample_ = false;
+    step_index_ = std::nullopt;
+    begin_index_ = std::nullopt;
+  }
+
+  std::tuple<float, float> _sigma_to_alpha_sigma_t(float sigma) const {
+    float alpha_t = 1.0f / std::sqrt(sigma * sigma + 1.0f);
+    float sigma_t = sigma * alpha_t;
+    return {alpha_t, sigma_t};
+  }
+
+  // The second match if timestep occurs more than once, the last index if
+  // it does not occur. Runs on the first step, so it does not allocate.
+  int index_for_timestep(int timestep) const {
+    int first = -1;
+    for (size_t i = 0; i < timesteps_.size(); ++i) {
+      if (timesteps_(i) == timestep) {
+        if (first >= 0) {
+          return int(i);
+        }
+        first = int(i);
+      }
+    }
+    return first >= 0 ? first : int(timesteps_.size()) - 1;
+  }
+
+  SchedulerOutput step(const xt::xarray<float> &model_output, int timestep,
+                       const xt::xarray<float> &sample) {
+    xt::xarray<float> prev_sample = sample;
+    step(model_output.data(), timestep, prev_sample.data(), prev_sample.size());
+    return {prev_sample};
+  }
+
+  // step() on raw buffers: updates the n floats of sample in place.
+  void step(const float *model_output, int timestep, float *sample, size_t n) {
+    step(model_output, nullptr, 1.0f, timestep, sample, n, nullptr, 0);
+  }
+
+  // The UniC corrector and UniP predictor of one diffusers step, fused with
+  // classifier-free guidance into one SIMD pass over memory like
+  // DPMSolverMultistepScheduler::step(). Both updates are expanded into one
+  // weight per buffer when set_timesteps() is called.
+  void step(const float *noise_pred_uncond, const float *noise_pred_text,
+            float guidance_scale, int timestep, float *sample, size_t n,
+            float *const *copies, int num_copies) override {
+    if (!num_inference_steps_) {
+      throw std::runtime_error("set_timesteps must be called before stepping");
+    }
+
+    if (!step_index_) {
+      step_index_ = index_for_timestep(timestep);
+    }
+    if (history_size_ != n) {
+      reserve(n);
+    }
+
+    int index = step_index_.value();
+    // The corrector runs at the order the previous step predicted with.
+    int corrector_order = (index > 0 && has_last_sample_) ? this_order_ : 0;
+    int order = solver_order_;
+    if (lower_order_final_) {
+      order = std::min(order, int(timesteps_.size()) - index);
+    }
+    order = std::min({order, lower_order_nums_ + 1, max_order()});
+
+    history_head_ = (history_head_ + 1) % history_slots();
+    FusedStep buffers{noise_pred_uncond,
+                      noise_pred_text,
+                      guidance_scale,
+                      sample,
+                      last_sample_.data(),
+                      {history_slot(0), history_slot(1), history_slot(2),
+                       history_slot(3)},
+                      copies,
+                      num_copies,
+                      n};
+    const Update &corrector =
+        correctors_[index * max_order() + std::max(corrector_order, 1) - 1];
+    const Update &predictor = predictors_[index * max_order() + order - 1];
+    switch (corrector_order) {
+      case 0:
+        fused_update<0>(order, buffers, conversions_[index], corrector,
+                        predictor);
+        break;
+      case 1:
+        fused_update<1>(order, buffers, conversions_[index], corrector,
+                        predictor);
+        break;
+      case 2:
+        fused_update<2>(order, buffers, conversions_[index], corrector,
+                        predictor);
+        break;
+      default:
+        fused_update<3>(order, buffers, conversions_[index], corrector,
+                        predictor);
+        break;
+    }
+
+    this_order_ = order;
+    has_last_sample_ = true;
+    if (lower_order_nums_ < solver_order_) {
+      lower_order_nums_++;
+    }
+
+    step_index_ = index + 1;
+  }
+
+  // Sizes the model output history and the last sample for samples of n
+  // floats up front, so that not even the first step allocates.
+  void reserve(size_t n) override {
+    history_.assign(history_slots() * n, 0.0f);
+    last_sample_.assign(n, 0.0f);
+    history_size_ = n;
+  }
+
+  void set_begin_index(int begin_index) override {
+    begin_index_ = begin_index;
+  }
+
+  xt::xarray<float> add_noise(const xt::xarray<float> &original_samples,
+                              const xt::xarray<float> &noise,
+                              const xt::xarray<int> &timesteps) const override {
+    std::vector<int> step_indices;
+
+    if (!begin_index_) {
+      for (size_t i = 0; i < timesteps.size(); ++i) {
+        step_indices.push_back(index_for_timestep(timesteps(i)));
+      }
+    } else if (step_index_) {
+      step_indices.resize(timesteps.size(), step_index_.value());
+    } else {
+      step_indices.resize(timesteps.size(), begin_index_.value());
+    }
+
+    xt::xarray<float> sigma = xt::zeros<float>({step_indices.size()});
+    for (size_t i = 0; i < step_indices.size(); ++i) {
+      sigma(i) = sigmas_(step_indices[i]);
+    }
+
+    std::vector<size_t> new_shape = {sigma.size(), 1, 1, 1};
+    auto reshaped_sigma = xt::reshape_view(sigma, new_shape);
+
+    xt::xarray<float> alpha_t =
+        xt::ones_like(reshaped_sigma) /
+        xt::sqrt(reshaped_sigma * reshaped_sigma + 1.0f);
+    xt::xarray<float> sigma_t = reshaped_sigma * alpha_t;
+
+    return alpha_t * original_samples + sigma_t * noise;
+  }
+
+  const xt::xarray<float> &get_timesteps() const override {
+    return timesteps_;
+  }
+  size_t get_step_index() const { return step_index_.value_or(0); }
+  const xt::xarray<float> &get_sigmas() const { return sigmas_; }
+
+ private:
+  int max_order() const { return std::clamp(solver_order_, 1, 3); }
+  // A step reads data predictions up to max_order() steps back.
+  int history_slots() const { return max_order() + 1; }
+
+  // Data prediction k steps back; slot 0 is the current step's.
+  float *history_slot(int k) {
+    if (k >= history_slots()) {
+      return nullptr;
+    }
+    int slot = (history_head_ + history_slots() - k) % history_slots();
+    return history_.data() + slot * history_size_;
+  }
+
+  // d0 = convert_sample * x + convert_output * noise_pred
+  struct Conversion {
+    float convert_sample = 0.0f;
+    float convert_output = 0.0f;
+  };
+
+  // x' = sample * x + sum over k of m[k] * (data prediction k steps back)
+  struct Update {
+    float sample = 0.0f;
+    std::array<float, 4> m{};
+  };
+
+  struct FusedStep {
+    const float *noise_pred_uncond;
+    const float *noise_pred_text;
+    float guidance_scale;
+    float *sample;
+    float *last_sample;
+    std::array<float *, 4> history;
+    float *const *copies;
+    int num_copies;
+    size_t n;
+  };
+
+  // Solves the order x order system R rho = b of diffusers' UniPC updates
+  // with Gaussian elimination, R[i][j] = rks[j]^i.
+  static std::array<double, 3> solve(const std::array<double, 3> &rks,
+                                     const std::array<double, 3> &b,
+                                     int order) {
+    double a[3][4] = {};
+    for (int i = 0; i < order; i++) {
+      for (int j = 0; j < order; j++) {
+        a[i][j] = std::pow(rks[j], i);
+      }
+      a[i][3] = b[i];
+    }
+    for (int col = 0; col < order; col++) {
+      int pivot = col;
+      for (int row = col + 1; row < order; row++) {
+        if (std::abs(a[row][col]) > std::abs(a[pivot][col])) {
+          pivot = row;
+        }
+      }
+      std::swap(a[col], a[pivot]);
+      for (int row = 0; row < order; row++) {
+        if (row == col) {
+          continue;
+        }
+        double factor = a[row][col] / a[col][col];
+        for (int k = col; k < 4; k++) {
+          a[row][k] -= factor * a[col][k];
+        }
+      }
+    }
+    std::array<double, 3> x{};
+    for (int i = 0; i < order; i++) {
+      x[i] = a[i][3] / a[i][i];
+    }
+    return x;
+  }
+
+  double lambda(int index) const {
+    auto [alpha, sigma] = _sigma_to_alpha_sigma_t(sigmas_(index));
+    return std::log(double(alpha)) - std::log(double(sigma));
+  }
+
+  // Weights of multistep_uni_p_bh_update() (corrector == false) or
+  // multistep_uni_c_bh_update() (corrector == true) between sigmas_(s0) and
+  // sigmas_(t), with the earlier data predictions at sigmas_(s0 - k) for
+  // k = 1 .. order - 1. History index 0 is this step's data prediction:
+  // the predictor's m0, the corrector's model_t. The corrector's m0 is one
+  // step back.
+  Update update_weights(int s0, int t, int order, bool corrector) const {
+    auto [alpha_t, sigma_t_val] = _sigma_to_alpha_sigma_t(sigmas_(t));
+    auto [alpha_s0, sigma_s0_val] = _sigma_to_alpha_sigma_t(sigmas_(s0));
+    double lambda_s0 = lambda(s0);
+    double h = lambda(t) - lambda_s0;
+    double hh = -h;
+    double h_phi_1 = std::expm1(hh);
+    double b_h = std::expm1(hh);
+
+    std::array<double, 3> rks{};
+    for (int k = 1; k < order; k++) {
+      rks[k - 1] = (lambda(s0 - k) - lambda_s0) / h;
+    }
+    rks[order - 1] = 1.0;
+    std::array<double, 3> b{};
+    double h_phi_k = h_phi_1 / hh - 1.0;
+    double factorial_i = 1.0;
+    for (int i = 1; i <= order; i++) {
+      b[i - 1] = h_phi_k * factorial_i / b_h;
+      factorial_i *= i + 1;
+      h_phi_k = h_phi_k / hh - 1.0 / factorial_i;
+    }
+
+    // rhos[k - 1] weighs D1_k = (m_k - m0) / r_k; for the corrector
+    // rhos[order - 1] weighs D1_t = model_t - m0.
+    std::array<double, 3> rhos{};
+    int m0 = corrector ? 1 : 0;
+    if (corrector) {
+      rhos = order == 1 ? std::array<double, 3>{0.5} : solve(rks, b, order);
+    } else if (order == 2) {
+      rhos = {0.5};
+    } else if (order > 2) {
+      rhos = solve(rks, b, order - 1);
+    }
+
+    double scale = alpha_t * b_h;
+    std::array<double, 4> m{};
+    m[m0] = -alpha_t * h_phi_1;
+    for (int k = 1; k < order; k++) {
+      m[m0 + k] -= scale * rhos[k - 1] / rks[k - 1];
+      m[m0] += scale * rhos[k - 1] / rks[k - 1];
+    }
+    if (corrector) {
+      m[0] -= scale * rhos[order - 1];
+      m[m0] += scale * rhos[order - 1];
+    }
+
+    Update update;
+    update.sample = sigma_t_val / sigma_s0_val;
+    for (int k = 0; k < 4; k++) {
+      update.m[k] = float(m[k]);
+    }
+    return update;
+  }
+
+  // Fills the conversion of every step index and the predictor and
+  // corrector weights of every step index and order it can run at.
+  void precompute_coefficients() {
+    if (prediction_type_ != "epsilon" && prediction_type_ != "v_prediction" &&
+        prediction_type_ != "sample") {
+      throw std::runtime_error(
+          prediction_type_ + " is not implemented for UniPCMultistepScheduler");
+    }
+
+    int steps = int(timesteps_.size());
+    conversions_.assign(steps, Conversion());
+    predictors_.assign(steps * max_order(), Update());
+    correctors_.assign(steps * max_order(), Update());
+    for (int index = 0; index < steps; index++) {
+      auto [alpha_s0, sigma_s0_val] = _sigma_to_alpha_sigma_t(sigmas_(index));
+      Conversion &conversion = conversions_[index];
+      if (prediction_type_ == "epsilon") {
+        conversion.convert_sample = 1.0f / alpha_s0;
+        conversion.convert_output = -sigma_s0_val / alpha_s0;
+      } else if (prediction_type_ == "v_prediction") {
+        conversion.convert_sample = alpha_s0;
+        conversion.convert_output = -sigma_s0_val;
+      } else {
+        conversion.convert_sample = 0.0f;
+        conversion.convert_output = 1.0f;
+      }
+
+      for (int order = 1; order <= max_order(); order++) {
+        // Orders the lower_order_nums / lower_order_final logic allows.
+        if (order <= index + 1 && order <= steps - index) {
+          predictors_[index * max_order() + order - 1] =
+              update_weights(index, index + 1, order, false);
+        }
+        if (order <= index) {
+          correctors_[index * max_order() + order - 1] =
+              update_weights(index - 1, index, order, true);
+        }
+      }
+    }
+  }
+
+  // Per element: the guided noise prediction is converted to this step's
+  // data prediction, the corrector refines the sample from the previous
+  // step's pre-prediction sample, and the predictor advances it. Reads
+  // every input and writes every output exactly once.
+  template <int CorrectorOrder>
+  static void fused_update(int order, const FusedStep &s, const Conversion &c,
+                           const Update &corrector, const Update &predictor) {
+    switch (order) {
+      case 1:
+        fused_update<CorrectorOrder, 1>(s, c, corrector, predictor);
+        break;
+      case 2:
+        fused_update<CorrectorOrder, 2>(s, c, corrector, predictor);
+        break;
+      default:
+        fused_update<CorrectorOrder, 3>(s, c, corrector, predictor);
+        break;
+    }
+  }
+
+  template <int CorrectorOrder, int PredictorOrder>
+  static void fused_update(const FusedStep &s, const Conversion &c,
+                           const Update &corrector, const Update &predictor) {
+    using batch = xsimd::batch<float>;
+    constexpr size_t width = batch::size;
+    const batch guidance(s.guidance_scale);
+    const batch convert_sample(c.convert_sample);
+    const batch convert_output(c.convert_output);
+    const batch corrector_sample(corrector.sample);
+    const batch predictor_sample(predictor.sample);
+    std::array<batch, 4> cm, pm;
+    for (int k = 0; k < 4; k++) {
+      cm[k] = batch(corrector.m[k]);
+      pm[k] = batch(predictor.m[k]);
+    }
+
+    size_t i = 0;
+    for (; i + width <= s.n; i += width) {
+      batch noise = batch::load_unaligned(s.noise_pred_uncond + i);
+      if (s.noise_pred_text) {
+        batch text = batch::load_unaligned(s.noise_pred_text + i);
+        noise = xsimd::fma(guidance, text - noise, noise);
+      }
+      batch x = batch::load_unaligned(s.sample + i);
+      batch m0 = xsimd::fma(convert_sample, x, convert_output * noise);
+      if constexpr (CorrectorOrder >= 1) {
+        batch corrected =
+            xsimd::fma(corrector_sample, batch::load_unaligned(s.last_sample + i),
+                       cm[0] * m0);
+        for (int k = 1; k <= CorrectorOrder; k++) {
+          corrected = xsimd::fma(
+              cm[k], batch::load_unaligned(s.history[k] + i), corrected);
+        }
+        x = corrected;
+      }
+      m0.store_unaligned(s.history[0] + i);
+      x.store_unaligned(s.last_sample + i);
+      batch next = xsimd::fma(predictor_sample, x, pm[0] * m0);
+      for (int k = 1; k < PredictorOrder; k++) {
+        next = xsimd::fma(pm[k], batch::load_unaligned(s.history[k] + i), next);
+      }
+      next.store_unaligned(s.sample + i);
+      for (int copy = 0; copy < s.num_copies; copy++) {
+        next.store_unaligned(s.copies[copy] + i);
+      }
+    }
+    for (; i < s.n; i++) {
+      float noise = s.noise_pred_uncond[i];
+      if (s.noise_pred_text) {
+        noise = std::fma(s.guidance_scale, s.noise_pred_text[i] - noise, noise);
+      }
+      float x = s.sample[i];
+      float m0 = std::fma(c.convert_sample, x, c.convert_output * noise);
+      if constexpr (CorrectorOrder >= 1) {
+        float corrected =
+            std::fma(corrector.sample, s.last_sample[i], corrector.m[0] * m0);
+        for (int k = 1; k <= CorrectorOrder; k++) {
+          corrected = std::fma(corrector.m[k], s.history[k][i], corrected);
+        }
+        x = corrected;
+      }
+      s.history[0][i] = m0;
+      s.last_sample[i] = x;
+      float next = std::fma(predictor.sample, x, predictor.m[0] * m0);
+      for (int k = 1; k < PredictorOrder; k++) {
+        next = std::fma(predictor.m[k], s.history[k][i], next);
+      }
+      s.sample[i] = next;
+      for (int copy = 0; copy < s.num_copies; copy++) {
+        s.copies[copy][i] = next;
+      }
+    }
+  }
+
+  int num_train_timesteps_;
+  float beta_start_;
+  float beta_end_;
+  std::string beta_schedule_;
+  int solver_order_;
+  std::string prediction_type_;
+  std::string timestep_spacing_;
+  bool lower_order_final_;
+
+  xt::xarray<float> betas_;
+  xt::xarray<float> alphas_;
+  xt::xarray<float> alphas_cumprod_;
+  xt::xarray<float> sigmas_;
+
+  std::optional<int> num_inference_steps_;
+  xt::xarray<float> timesteps_;
+  // Per step index i, and for order o at [i * max_order() + o - 1].
+  std::vector<Conversion> conversions_;
+  std::vector<Update> predictors_;
+  std::vector<Update> correctors_;
+  // Ring of the last history_slots() data predictions, history_size_ floats
+  // each; history_head_ is the current step's slot.
+  std::vector<float, xsimd::aligned_allocator<float, 64>> history_;
+  // The sample before the previous step's prediction, for the corrector.
+  std::vector<float, xsimd::aligned_allocator<float, 64>> last_sample_;
+  size_t history_size_ = 0;
+  int history_head_ = 0;
+  int lower_order_nums_ = 0;
+  int this_order_ = 0;
+  bool has_last_sample_ = false;
+  std::optional<int> step_index_;
+  std::optional<int> begin_index_;
+};
+
+#endif  // UNIPCMULTISTEPSCHEDULER_HPP
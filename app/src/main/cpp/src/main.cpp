@@ -1,6 +1,15 @@
 #include <iostream>
+#include <atomic>
+#include <map>
+#include <future>
 #include <memory>
+#include <random>
 #include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "BuildId.hpp"
 #include "DynamicLoadUtil.hpp"
@@ -15,30 +24,72 @@
 #include "httplib.h"
 #include "json.hpp"
 #include "DPMSolverMultistepScheduler.hpp"
+#include "UniPCMultistepScheduler.hpp"
+#include "LCMScheduler.hpp"
 #include "Config.hpp"
 #include "SDUtils.hpp"
 #include "QnnModel.hpp"
+#include "JobQueue.hpp"
+#include "ResultStore.hpp"
+#include "ImageEncoder.hpp"
+#include "EmbeddingCache.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "ResultCache.hpp"
+#include "LatencyModel.hpp"
+#include "StepScheduler.hpp"
 
 #include <MNN/Interpreter.hpp>
 #include <MNN/MNNDefine.h>
 
 int port = 8081;
 std::string listen_address = "127.0.0.1";
-
-static void *sg_backendHandle_clip{nullptr};
-static void *sg_backendHandle_unet{nullptr};
-static void *sg_backendHandle_vae_decoder{nullptr};
-static void *sg_backendHandle_vae_encoder{nullptr};
+int queue_size = 4;
+int result_store_size = 8;
+int max_images_per_request = 8;
+int embedding_cache_mb = 16;
+bool enable_trace = false;
+int result_cache_mb = 64;
+std::string result_cache_dir;
+int result_cache_disk_mb = 256;
+std::string unix_socket_path;
+int warmup_steps = 0;
+SchedulePolicy schedule_policy = SchedulePolicy::ROUND_ROBIN;
+int max_active_jobs = 4;
+
+static void *sg_backendHandle{nullptr};
 static void *sg_modelHandle{nullptr};
 
-std::shared_ptr<tokenizers::Tokenizer> g_tokenizer;
 std::unordered_map<std::string, int> g_token2id;
 std::unordered_map<int, std::string> g_id2token;
 
-MNN::Session *safetyCheckerSession;
-bool use_safety_checker = false;
-bool img2img = false;
-float nsfw_threshold = 0.5f;
+std::unique_ptr<TextEmbeddingCache> g_embeddingCache;
+std::unique_ptr<ResultCache> g_resultCache;
+// False until the startup warm-up has run; /health reports 503 meanwhile.
+std::atomic<bool> g_ready{false};
+LatencyModel g_latencyModel;
+// Estimated milliseconds of work queued or running, for deadline planning.
+std::atomic<int64_t> g_backlogMs{0};
+
+MetricsRegistry g_metrics;
+Histogram &g_clipMs = g_metrics.histogram("sd_clip_ms", "CLIP text encoder latency in milliseconds.", latencyBucketsMs());
+Histogram &g_unetStepMs = g_metrics.histogram("sd_unet_step_ms", "Latency of one UNet step in milliseconds.", latencyBucketsMs());
+Histogram &g_schedulerStepMs = g_metrics.histogram("sd_scheduler_step_ms", "Latency of one scheduler step (CFG combine and update) in milliseconds.", latencyBucketsMs());
+Histogram &g_vaeEncodeMs = g_metrics.histogram("sd_vae_encode_ms", "VAE encoder latency in milliseconds.", latencyBucketsMs());
+Histogram &g_vaeDecodeMs = g_metrics.histogram("sd_vae_decode_ms", "VAE decoder latency in milliseconds.", latencyBucketsMs());
+Histogram &g_safetyCheckMs = g_metrics.histogram("sd_safety_check_ms", "Safety checker latency in milliseconds.", latencyBucketsMs());
+Histogram &g_imageEncodeMs = g_metrics.histogram("sd_image_encode_ms", "PNG/JPEG compression latency in milliseconds.", latencyBucketsMs());
+Histogram &g_base64Ms = g_metrics.histogram("sd_base64_encode_ms", "Base64 encoding latency of inline results in milliseconds.", latencyBucketsMs());
+Histogram &g_sendMs = g_metrics.histogram("sd_sse_send_ms", "Time to write one SSE event to the client in milliseconds.", latencyBucketsMs());
+Histogram &g_queueWaitMs = g_metrics.histogram("sd_queue_wait_ms", "Time a job spent in the queue before the worker picked it up, in milliseconds.", latencyBucketsMs());
+Gauge &g_jobsInFlight = g_metrics.gauge("sd_jobs_in_flight", "Accepted jobs whose event stream is not finished yet.");
+Gauge &g_jobsActive = g_metrics.gauge("sd_jobs_active", "Jobs the inference worker is interleaving pipeline stages of.");
+Counter &g_jobsCompleted = g_metrics.counter("sd_jobs_completed_total", "Jobs that generated all requested images.");
+Counter &g_jobsFailed = g_metrics.counter("sd_jobs_failed_total", "Jobs that ended with an error.");
+Counter &g_jobsCancelled = g_metrics.counter("sd_jobs_cancelled_total", "Jobs cancelled by the client.");
+Counter &g_jobsRejected = g_metrics.counter("sd_jobs_rejected_total", "Requests rejected with 429 because the queue was full.");
+Counter &g_jobsDeadlineRejected = g_metrics.counter("sd_jobs_deadline_rejected_total", "Requests rejected with 422 because their deadline_ms cannot be met.");
+Counter &g_imagesGenerated = g_metrics.counter("sd_images_generated_total", "Images produced by the pipeline.");
 
 namespace qnn
 {
@@ -122,24 +173,108 @@ namespace qnn
                 std::exit(EXIT_FAILURE);
             }
 
-            struct ModelApps
+            // Command-line settings shared by every model set the server
+            // loads, including sets loaded later through /models/load.
+            struct BackendOptions
+            {
+                std::string backEndPath;
+                std::string systemLibraryPath;
+                std::string inputListPaths;
+                std::string outputPath;
+                std::string opPackagePaths;
+                std::string saveBinaryName;
+                bool debug = false;
+                iotensor::OutputDataType outputDataType = iotensor::OutputDataType::FLOAT_ONLY;
+                iotensor::InputDataType inputDataType = iotensor::InputDataType::FLOAT;
+                ProfilingLevel profilingLevel = ProfilingLevel::OFF;
+                bool loadFromCachedBinary = true;
+            };
+
+            // UNet and VAE files of one output size. Their graphs have fixed
+            // shapes, so every size requests may ask for needs its own.
+            // vae_encoder is optional; without it img2img is off at that size.
+            struct ResolutionPaths
+            {
+                std::string unet;
+                std::string vae_decoder;
+                std::string vae_encoder;
+            };
+
+            // Files of one model set. safety_checker is optional; without it
+            // the safety check is off.
+            struct ModelPaths
+            {
+                std::string clip;
+                // Keyed by output size in pixels.
+                std::map<int, ResolutionPaths> resolutions;
+                std::string safety_checker;
+                std::string tokenizer;
+                int text_embedding_size = default_text_embedding_size;
+            };
+
+            struct ResolutionApps
             {
-                std::unique_ptr<QnnModel> clip;
                 std::unique_ptr<QnnModel> unet;
                 std::unique_ptr<QnnModel> vae_decoder;
                 std::unique_ptr<QnnModel> vae_encoder;
-                MNN::Interpreter *safety_checker_mnn;
             };
 
-            ModelApps processCommandLine(int argc,
-                                         char **argv,
-                                         bool &loadFromCachedBinary,
-                                         std::string &clipPath,
-                                         std::string &unetPath,
-                                         std::string &vaeEncoderPath,
-                                         std::string &vaeDecoderPath,
-                                         std::string &safetyCheckerPath,
-                                         std::string &tokenizerPath)
+            // All graphs stay resident; a job uses the ResolutionApps of its
+            // size next to the shared CLIP, tokenizer and safety checker.
+            struct ModelApps
+            {
+                ModelPaths paths;
+                std::unique_ptr<QnnModel> clip;
+                std::map<int, ResolutionApps> resolutions;
+                MNN::Interpreter *safety_checker_mnn = nullptr;
+                MNN::Session *safety_checker_session = nullptr;
+                std::shared_ptr<tokenizers::Tokenizer> tokenizer;
+                // modelFileIdentity() of all files, for result cache keys.
+                std::string identity;
+                // modelFileIdentity() of the CLIP file, for embedding cache keys.
+                std::string clip_identity;
+
+                // nullptr if no graphs were loaded for size.
+                const ResolutionApps *resolution(int size) const
+                {
+                    auto it = resolutions.find(size);
+                    return it == resolutions.end() ? nullptr : &it->second;
+                }
+
+                ~ModelApps()
+                {
+                    if (safety_checker_mnn)
+                    {
+                        if (safety_checker_session)
+                        {
+                            safety_checker_mnn->releaseSession(safety_checker_session);
+                        }
+                        MNN::Interpreter::destroy(safety_checker_mnn);
+                    }
+                }
+            };
+
+            // Splits a model path argument of the form [size:]path. Without
+            // a size prefix the file is for default_output_size.
+            bool parseSizedModelPath(const std::string &arg, int &size, std::string &path)
+            {
+                size = default_output_size;
+                path = arg;
+                auto colon = arg.find(':');
+                if (colon == std::string::npos || colon == 0 ||
+                    arg.find_first_not_of("0123456789") != colon)
+                {
+                    return true;
+                }
+                size = std::stoi(arg.substr(0, colon));
+                path = arg.substr(colon + 1);
+                return size > 0 && size % 8 == 0;
+            }
+
+            void processCommandLine(int argc,
+                                    char **argv,
+                                    BackendOptions &options,
+                                    ModelPaths &paths)
             {
                 {
                     enum OPTIONS
@@ -151,6 +286,16 @@ namespace qnn
                         OPT_TEXT_EMBEDDING_SIZE = 24,
                         OPT_SAFETY_CHECKER = 27,
                         OPT_IMG2IMG = 29,
+                        OPT_QUEUE_SIZE = 30,
+                        OPT_EMBEDDING_CACHE = 31,
+                        OPT_TRACE = 32,
+                        OPT_RESULT_CACHE = 33,
+                        OPT_RESULT_CACHE_DIR = 34,
+                        OPT_RESULT_CACHE_DISK = 35,
+                        OPT_UNIX_SOCKET = 36,
+                        OPT_WARMUP_STEPS = 37,
+                        OPT_SCHEDULE_POLICY = 38,
+                        OPT_MAX_ACTIVE_JOBS = 39,
                         OPT_BACKEND = 3,
                         OPT_INPUT_LIST = 4,
                         OPT_OUTPUT_DIR = 5,
@@ -170,6 +315,16 @@ namespace qnn
                     static struct pal::Option s_longOptions[] = {
                             {"help", pal::no_argument, NULL, OPT_HELP},
                             {"port", pal::required_argument, NULL, OPT_PORT},
+                            {"queue_size", pal::required_argument, NULL, OPT_QUEUE_SIZE},
+                            {"embedding_cache_mb", pal::required_argument, NULL, OPT_EMBEDDING_CACHE},
+                            {"trace", pal::no_argument, NULL, OPT_TRACE},
+                            {"result_cache_mb", pal::required_argument, NULL, OPT_RESULT_CACHE},
+                            {"result_cache_dir", pal::required_argument, NULL, OPT_RESULT_CACHE_DIR},
+                            {"result_cache_disk_mb", pal::required_argument, NULL, OPT_RESULT_CACHE_DISK},
+                            {"unix_socket", pal::required_argument, NULL, OPT_UNIX_SOCKET},
+                            {"warmup_steps", pal::required_argument, NULL, OPT_WARMUP_STEPS},
+                            {"schedule_policy", pal::required_argument, NULL, OPT_SCHEDULE_POLICY},
+                            {"max_active_jobs", pal::required_argument, NULL, OPT_MAX_ACTIVE_JOBS},
                             {"text_embedding_size", pal::required_argument, NULL, OPT_TEXT_EMBEDDING_SIZE},
                             {"safety_checker", pal::required_argument, NULL, OPT_SAFETY_CHECKER},
                             {"vae_encoder", pal::required_argument, NULL, OPT_IMG2IMG},
@@ -218,14 +373,22 @@ namespace qnn
                                 std::exit(EXIT_SUCCESS);
                                 break;
                             case OPT_CLIP:
-                                clipPath = pal::g_optArg;
+                                paths.clip = pal::g_optArg;
                                 break;
                             case OPT_UNET:
-                                unetPath = pal::g_optArg;
-                                break;
                             case OPT_VAE_DECODER:
-                                vaeDecoderPath = pal::g_optArg;
+                            case OPT_IMG2IMG:
+                            {
+                                int size;
+                                std::string path;
+                                if (!parseSizedModelPath(pal::g_optArg, size, path))
+                                {
+                                    showHelpAndExit("Model sizes must be positive multiples of 8.");
+                                }
+                                auto &resolution = paths.resolutions[size];
+                                (opt == OPT_UNET ? resolution.unet : opt == OPT_VAE_DECODER ? resolution.vae_decoder : resolution.vae_encoder) = path;
                                 break;
+                            }
                             case OPT_BACKEND:
                                 backEndPath = pal::g_optArg;
                                 break;
@@ -233,15 +396,10 @@ namespace qnn
                                 inputListPaths = pal::g_optArg;
                                 break;
                             case OPT_TEXT_EMBEDDING_SIZE:
-                                text_embedding_size = std::stoi(pal::g_optArg);
+                                paths.text_embedding_size = std::stoi(pal::g_optArg);
                                 break;
                             case OPT_SAFETY_CHECKER:
-                                use_safety_checker = true;
-                                safetyCheckerPath = pal::g_optArg;
-                                break;
-                            case OPT_IMG2IMG:
-                                img2img = true;
-                                vaeEncoderPath = pal::g_optArg;
+                                paths.safety_checker = pal::g_optArg;
                                 break;
                             case OPT_DEBUG_OUTPUTS:
                                 debug = true;
@@ -297,32 +455,73 @@ namespace qnn
                                 port = std::stoi(pal::g_optArg);
                                 break;
                             case OPT_TOKENIZER:
-                                tokenizerPath = pal::g_optArg;
+                                paths.tokenizer = pal::g_optArg;
+                                break;
+                            case OPT_QUEUE_SIZE:
+                                queue_size = std::stoi(pal::g_optArg);
+                                if (queue_size < 1)
+                                {
+                                    showHelpAndExit("Queue size must be at least 1.");
+                                }
+                                break;
+                            case OPT_EMBEDDING_CACHE:
+                                embedding_cache_mb = std::max(0, std::stoi(pal::g_optArg));
+                                break;
+                            case OPT_TRACE:
+                                enable_trace = true;
+                                break;
+                            case OPT_RESULT_CACHE:
+                                result_cache_mb = std::max(0, std::stoi(pal::g_optArg));
+                                break;
+                            case OPT_RESULT_CACHE_DIR:
+                                result_cache_dir = pal::g_optArg;
+                                break;
+                            case OPT_RESULT_CACHE_DISK:
+                                result_cache_disk_mb = std::max(0, std::stoi(pal::g_optArg));
+                                break;
+                            case OPT_UNIX_SOCKET:
+                                unix_socket_path = pal::g_optArg;
+                                if (unix_socket_path.empty() || unix_socket_path.size() >= sizeof(sockaddr_un::sun_path))
+                                {
+                                    showHelpAndExit("Invalid unix socket path.");
+                                }
+                                break;
+                            case OPT_WARMUP_STEPS:
+                                warmup_steps = std::max(0, std::stoi(pal::g_optArg));
+                                break;
+                            case OPT_SCHEDULE_POLICY:
+                                if (!parseSchedulePolicy(pal::g_optArg, schedule_policy))
+                                {
+                                    showHelpAndExit("Schedule policy must be fifo, round_robin or shortest_remaining.");
+                                }
+                                break;
+                            case OPT_MAX_ACTIVE_JOBS:
+                                max_active_jobs = std::stoi(pal::g_optArg);
+                                if (max_active_jobs < 1)
+                                {
+                                    showHelpAndExit("Max active jobs must be at least 1.");
+                                }
                                 break;
                             default:
                                 showHelpAndExit("Invalid argument passed.");
                         }
                     }
 
-                    if (clipPath.empty() || unetPath.empty() || vaeDecoderPath.empty())
+                    if (paths.clip.empty() || paths.resolutions.empty())
                     {
                         showHelpAndExit("Missing required model paths: --clip, --unet, and/or --vae_decoder");
                     }
-                    if (tokenizerPath.empty())
-                    {
-                        showHelpAndExit("Missing option: --tokenizer");
-                    }
-                    if (use_safety_checker && safetyCheckerPath.empty())
+                    for (const auto &resolution : paths.resolutions)
                     {
-                        showHelpAndExit("Missing option: --safety_checker");
+                        if (resolution.second.unet.empty() || resolution.second.vae_decoder.empty())
+                        {
+                            showHelpAndExit("Size " + std::to_string(resolution.first) + " needs both --unet and --vae_decoder");
+                        }
                     }
-
-                    ModelApps apps;
-                    if (use_safety_checker)
+                    if (paths.tokenizer.empty())
                     {
-                        apps.safety_checker_mnn = MNN::Interpreter::createFromFile(safetyCheckerPath.c_str());
+                        showHelpAndExit("Missing option: --tokenizer");
                     }
-
                     if (systemLibraryPath.empty())
                     {
                         showHelpAndExit("Requires system library path.");
@@ -332,139 +531,178 @@ namespace qnn
                         showHelpAndExit("Missing option: --backend");
                     }
 
-                    QnnFunctionPointers qnnFunctionPointers_clip, qnnFunctionPointers_unet, qnnFunctionPointers_vae_decoder, qnnFunctionPointers_vae_encoder;
+                    options.backEndPath = backEndPath;
+                    options.systemLibraryPath = systemLibraryPath;
+                    options.inputListPaths = inputListPaths;
+                    options.outputPath = outputPath;
+                    options.opPackagePaths = opPackagePaths;
+                    options.saveBinaryName = saveBinaryName;
+                    options.debug = debug;
+                    options.outputDataType = parsedOutputDataType;
+                    options.inputDataType = parsedInputDataType;
+                    options.profilingLevel = parsedProfilingLevel;
+                }
 
-                    // CLIP
-                    auto status = dynamicloadutil::getQnnFunctionPointers(
-                            backEndPath, clipPath, &qnnFunctionPointers_clip,
-                            &sg_backendHandle_clip, false, &sg_modelHandle);
-                    if (dynamicloadutil::StatusCode::SUCCESS != status)
-                    {
-                        showHelpAndExit("Failed to get CLIP QNN function pointers.");
-                    }
+            } // namespace sample_app
+        } // namespace tools
+    } // namespace qnn
+}
 
-                    // UNET
-                    status = dynamicloadutil::getQnnFunctionPointers(
-                            backEndPath, unetPath, &qnnFunctionPointers_unet,
-                            &sg_backendHandle_unet, false, &sg_modelHandle);
-                    if (dynamicloadutil::StatusCode::SUCCESS != status)
-                    {
-                        showHelpAndExit("Failed to get UNET QNN function pointers.");
-                    }
+using qnn::tools::sample_app::BackendOptions;
+using qnn::tools::sample_app::ModelApps;
+using qnn::tools::sample_app::ModelPaths;
+using qnn::tools::sample_app::ResolutionApps;
+using qnn::tools::sample_app::ResolutionPaths;
+
+// Function pointers of the backend and system libraries. They are resolved
+// once and shared by every model set, so swapping models never reopens the
+// libraries.
+static QnnFunctionPointers sg_qnnFunctionPointers;
+
+// The model set new jobs start on, nullptr after /models/unload. Replaced
+// only under g_modelAppsMutex, which the inference worker holds for one
+// pipeline stage at a time, so a swap lands between two stages. Jobs
+// already running are unaffected: each keeps its own shared_ptr to the set
+// it started on. Status endpoints read it with std::atomic_load instead of
+// waiting for the running stage.
+std::mutex g_modelAppsMutex;
+std::shared_ptr<ModelApps> g_modelApps;
+
+bool loadBackendLibraries(const BackendOptions &options)
+{
+    auto status = qnn::tools::dynamicloadutil::getQnnFunctionPointers(
+            options.backEndPath, "", &sg_qnnFunctionPointers,
+            &sg_backendHandle, false, &sg_modelHandle);
+    if (qnn::tools::dynamicloadutil::StatusCode::SUCCESS != status)
+    {
+        std::cerr << "Failed to get QNN function pointers." << std::endl;
+        return false;
+    }
+    status = qnn::tools::dynamicloadutil::getQnnSystemFunctionPointers(
+            options.systemLibraryPath, &sg_qnnFunctionPointers);
+    if (qnn::tools::dynamicloadutil::StatusCode::SUCCESS != status)
+    {
+        std::cerr << "Failed to get QNN system function pointers." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-                    // VAE Decoder
-                    status = dynamicloadutil::getQnnFunctionPointers(
-                            backEndPath, vaeDecoderPath, &qnnFunctionPointers_vae_decoder,
-                            &sg_backendHandle_vae_decoder, false, &sg_modelHandle);
-                    if (dynamicloadutil::StatusCode::SUCCESS != status)
-                    {
-                        showHelpAndExit("Failed to get VAE Decoder QNN function pointers.");
-                    }
+std::unique_ptr<QnnModel> createQnnApp(const BackendOptions &options, const std::string &modelPath, const std::string &appType)
+{
+    auto app = std::make_unique<QnnModel>(
+            sg_qnnFunctionPointers,
+            options.inputListPaths,
+            options.opPackagePaths,
+            sg_backendHandle,
+            options.outputPath,
+            options.debug,
+            options.outputDataType,
+            options.inputDataType,
+            options.profilingLevel,
+            true,
+            modelPath,
+            options.saveBinaryName);
+    if (qnn::tools::sample_app::initializeQnnApp(modelPath, app, options.loadFromCachedBinary, appType) != EXIT_SUCCESS)
+    {
+        return nullptr;
+    }
+    return app;
+}
 
-                    if (img2img)
-                    {
-                        // VAE Encoder
-                        status = dynamicloadutil::getQnnFunctionPointers(
-                                backEndPath, vaeEncoderPath, &qnnFunctionPointers_vae_encoder,
-                                &sg_backendHandle_vae_encoder, false, &sg_modelHandle);
-                        if (dynamicloadutil::StatusCode::SUCCESS != status)
-                        {
-                            showHelpAndExit("Failed to get VAE Encoder QNN function pointers.");
-                        }
-                    }
+// Loads and initializes a complete model set without touching the one being
+// served. current, if set, is the served set; its tokenizer is shared when
+// the tokenizer file is unchanged. Returns nullptr with error set on failure.
+std::shared_ptr<ModelApps> loadModelApps(const BackendOptions &options, const ModelPaths &paths, const ModelApps *current, std::string &error)
+{
+    auto apps = std::make_shared<ModelApps>();
+    apps->paths = paths;
+    std::vector<std::string> files = {paths.clip, paths.safety_checker};
+    for (const auto &resolution : paths.resolutions)
+    {
+        files.push_back(std::to_string(resolution.first));
+        files.push_back(resolution.second.unet);
+        files.push_back(resolution.second.vae_decoder);
+        files.push_back(resolution.second.vae_encoder);
+    }
+    apps->identity = modelFileIdentity(files);
+    apps->clip_identity = modelFileIdentity({paths.clip});
 
-                    if (!systemLibraryPath.empty())
-                    {
-                        for (auto *functionPointers : {&qnnFunctionPointers_clip, &qnnFunctionPointers_unet, &qnnFunctionPointers_vae_decoder})
-                        {
-                            status = dynamicloadutil::getQnnSystemFunctionPointers(
-                                    systemLibraryPath, functionPointers);
-                            if (dynamicloadutil::StatusCode::SUCCESS != status)
-                            {
-                                showHelpAndExit("Failed to get QNN system function pointers.");
-                            }
-                        }
-                        if (img2img)
-                        {
-                            status = dynamicloadutil::getQnnSystemFunctionPointers(
-                                    systemLibraryPath, &qnnFunctionPointers_vae_encoder);
-                            if (dynamicloadutil::StatusCode::SUCCESS != status)
-                            {
-                                showHelpAndExit("Failed to get VAE Encoder system function pointers.");
-                            }
-                        }
-                    }
+    if (current && current->paths.tokenizer == paths.tokenizer)
+    {
+        apps->tokenizer = current->tokenizer;
+    }
+    else
+    {
+        try
+        {
+            auto blob = LoadBytesFromFile(paths.tokenizer);
+            apps->tokenizer = tokenizers::Tokenizer::FromBlobJSON(blob);
+        }
+        catch (const std::exception &e)
+        {
+            error = std::string("Failed to load tokenizer: ") + e.what();
+            return nullptr;
+        }
+    }
 
-                    apps.clip = std::make_unique<QnnModel>(
-                            qnnFunctionPointers_clip,
-                            inputListPaths,
-                            opPackagePaths,
-                            sg_backendHandle_clip,
-                            outputPath,
-                            debug,
-                            parsedOutputDataType,
-                            parsedInputDataType,
-                            parsedProfilingLevel,
-                            true,
-                            clipPath,
-                            saveBinaryName);
-
-                    apps.unet = std::make_unique<QnnModel>(
-                            qnnFunctionPointers_unet,
-                            inputListPaths,
-                            opPackagePaths,
-                            sg_backendHandle_unet,
-                            outputPath,
-                            debug,
-                            parsedOutputDataType,
-                            parsedInputDataType,
-                            parsedProfilingLevel,
-                            true,
-                            unetPath,
-                            saveBinaryName);
-
-                    apps.vae_decoder = std::make_unique<QnnModel>(
-                            qnnFunctionPointers_vae_decoder,
-                            inputListPaths,
-                            opPackagePaths,
-                            sg_backendHandle_vae_decoder,
-                            outputPath,
-                            debug,
-                            parsedOutputDataType,
-                            parsedInputDataType,
-                            parsedProfilingLevel,
-                            true,
-                            vaeDecoderPath,
-                            saveBinaryName);
-
-                    if (img2img)
-                    {
-                        apps.vae_encoder = std::make_unique<QnnModel>(
-                                qnnFunctionPointers_vae_encoder,
-                                inputListPaths,
-                                opPackagePaths,
-                                sg_backendHandle_vae_encoder,
-                                outputPath,
-                                debug,
-                                parsedOutputDataType,
-                                parsedInputDataType,
-                                parsedProfilingLevel,
-                                true,
-                                vaeEncoderPath,
-                                saveBinaryName);
-                    }
-                    return apps;
-                }
+    if (!paths.safety_checker.empty())
+    {
+        apps->safety_checker_mnn = MNN::Interpreter::createFromFile(paths.safety_checker.c_str());
+        if (!apps->safety_checker_mnn)
+        {
+            error = "Failed to load Safety Checker MNN model";
+            return nullptr;
+        }
+        MNN::BackendConfig backendConfig;
+        backendConfig.memory = MNN::BackendConfig::Memory_Low;
+        backendConfig.power = MNN::BackendConfig::Power_High;
+        MNN::ScheduleConfig config;
+        config.type = MNN_FORWARD_CPU;
+        config.numThread = 1;
+        config.backendConfig = &backendConfig;
+        apps->safety_checker_session = apps->safety_checker_mnn->createSession(config);
+    }
 
-            } // namespace sample_app
-        } // namespace tools
-    } // namespace qnn
+    apps->clip = createQnnApp(options, paths.clip, "Clip");
+    if (!apps->clip)
+    {
+        error = "Failed to initialize CLIP model: " + paths.clip;
+        return nullptr;
+    }
+    for (const auto &entry : paths.resolutions)
+    {
+        const ResolutionPaths &files = entry.second;
+        ResolutionApps &resolution = apps->resolutions[entry.first];
+        resolution.unet = createQnnApp(options, files.unet, "Unet");
+        if (!resolution.unet)
+        {
+            error = "Failed to initialize UNet model: " + files.unet;
+            return nullptr;
+        }
+        resolution.vae_decoder = createQnnApp(options, files.vae_decoder, "VaeDecoder");
+        if (!resolution.vae_decoder)
+        {
+            error = "Failed to initialize VAE Decoder model: " + files.vae_decoder;
+            return nullptr;
+        }
+        if (!files.vae_encoder.empty())
+        {
+            resolution.vae_encoder = createQnnApp(options, files.vae_encoder, "VaeEncoder");
+            if (!resolution.vae_encoder)
+            {
+                error = "Failed to initialize VAE Encoder model: " + files.vae_encoder;
+                return nullptr;
+            }
+        }
+    }
+    return apps;
 }
 
-std::vector<int> EncodeText(const std::string &text, int bos, int pad, int max_length)
+std::vector<int> EncodeText(tokenizers::Tokenizer &tokenizer, const std::string &text, int bos, int pad, int max_length, int text_embedding_size)
 {
     int sd21_pad = 0;
-    std::vector<int> ids = g_tokenizer->Encode(text);
+    std::vector<int> ids = tokenizer.Encode(text);
     ids.insert(ids.begin(), bos);
     if (ids.size() > max_length - 1)
     {
@@ -487,21 +725,19 @@ std::vector<int> EncodeText(const std::string &text, int bos, int pad, int max_l
     return ids;
 }
 
+// Token ids of the ctx.batchSize() CLIP inputs, the negative prompt first.
 std::vector<int> processPrompt(
+        tokenizers::Tokenizer &tokenizer,
+        const GenerationContext &ctx,
         const std::string &prompt,
         const std::string &negative_prompt = "",
-        const int max_length = 77, bool use_cfg = true)
+        const int max_length = 77)
 {
-    std::vector<int> prompt_ids = EncodeText(prompt, 49406, 49407, max_length);
-    std::vector<int> negative_prompt_ids = EncodeText(negative_prompt, 49406, 49407, max_length);
+    std::vector<int> prompt_ids = EncodeText(tokenizer, prompt, 49406, 49407, max_length, ctx.text_embedding_size);
+    std::vector<int> negative_prompt_ids = EncodeText(tokenizer, negative_prompt, 49406, 49407, max_length, ctx.text_embedding_size);
     std::vector<int> ids;
-    int batch_size = 1;
-    if (use_cfg)
-    {
-        batch_size = 2;
-    }
-    ids.reserve(batch_size * max_length);
-    if (use_cfg)
+    ids.reserve(ctx.batchSize() * max_length);
+    if (ctx.use_cfg)
     {
         ids.insert(ids.end(), negative_prompt_ids.begin(), negative_prompt_ids.end());
     }
@@ -509,191 +745,393 @@ std::vector<int> processPrompt(
     return ids;
 }
 
-GenerationResult generateImage(
-        const std::string &prompt,
-        const std::string &negative_prompt,
-        int steps,
-        float cfg,
-        bool use_cfg,
-        unsigned seed,
-        std::vector<float> img_data,
-        float denoise_strength,
-        QnnModel *clipApp,
-        QnnModel *unetApp,
-        QnnModel *vaeDecoderApp,
-        QnnModel *vaeEncoderApp,
-        MNN::Interpreter *safetyCheckerInterpreter,
-        std::function<void(int step, int total_steps)> progress_callback)
+// The step count LCM models are distilled on, and so the most an LCM
+// generation can use.
+constexpr int lcm_original_inference_steps = 50;
+
+// All samplers share the noise schedule the SD 1.x/2.x UNets were trained
+// with.
+std::unique_ptr<Scheduler> makeScheduler(SchedulerType type)
 {
-    using namespace qnn::tools::sample_app;
-    if (use_safety_checker && safetyCheckerInterpreter == nullptr)
+    switch (type)
     {
-        throw std::runtime_error("Safety Checker model not initialized");
+        case SchedulerType::UNIPC:
+            return std::make_unique<UniPCMultistepScheduler>(1000, 0.00085f, 0.012f, "scaled_linear", 2, "epsilon", "leading");
+        case SchedulerType::LCM:
+            return std::make_unique<LCMScheduler>(1000, 0.00085f, 0.012f, "scaled_linear", lcm_original_inference_steps, "epsilon");
+        default:
+            return std::make_unique<DPMSolverMultistepScheduler>(1000, 0.00085f, 0.012f, "scaled_linear", 2, "epsilon", "leading");
     }
-    if (!clipApp || !unetApp || !vaeDecoderApp)
+}
+
+// Sinusoidal embedding of the guidance scale that LCM-distilled UNets take
+// as timestep_cond in place of classifier-free guidance; diffusers'
+// get_guidance_scale_embedding() of guidance_scale - 1.
+void guidanceScaleEmbedding(float guidance_scale, AlignedFloats &embedding)
+{
+    size_t half_dim = embedding.size() / 2;
+    double w = (guidance_scale - 1.0) * 1000.0;
+    double scale = half_dim > 1 ? std::log(10000.0) / (half_dim - 1) : 0.0;
+    std::fill(embedding.begin(), embedding.end(), 0.0f);
+    for (size_t i = 0; i < half_dim; i++)
     {
-        throw std::runtime_error("Models not initialized");
+        double angle = w * std::exp(-scale * i);
+        embedding[i] = (float)std::sin(angle);
+        embedding[half_dim + i] = (float)std::cos(angle);
     }
-    if (img2img && !vaeEncoderApp)
+}
+
+class GenerationCancelled : public std::runtime_error
+{
+public:
+    GenerationCancelled() : std::runtime_error("Generation cancelled") {}
+};
+
+// One generation in progress, advanced one pipeline stage at a time so the
+// inference worker can interleave the UNet steps of several jobs. Owns all
+// state that has to survive between stages: the GenerationContext with the
+// shapes, flags and UNet buffers, the scheduler and the latents of the
+// image being denoised.
+//
+// The prompt is encoded by CLIP once and the UNet steps and VAE decode then
+// run for every seed in turn; each image is handed to result_callback as
+// soon as its VAE decode (and safety check) finishes.
+//
+// progress_callback returns false to stop the generation; cancelled is polled
+// before every stage. Either way UNet tensors are released and
+// GenerationCancelled is thrown.
+class GenerationTask
+{
+public:
+    using ProgressCallback = std::function<bool(int step, int total_steps, const float *latents)>;
+    using ResultCallback = std::function<void(size_t index, GenerationResult result)>;
+
+    GenerationTask(
+            std::shared_ptr<ModelApps> models,
+            std::string prompt,
+            std::string negative_prompt,
+            int steps,
+            float cfg,
+            bool use_cfg,
+            std::vector<unsigned> seeds,
+            std::vector<float> img_data,
+            float denoise_strength,
+            int size,
+            bool img2img,
+            SchedulerType scheduler_type,
+            ProgressCallback progress_callback,
+            ResultCallback result_callback,
+            const std::atomic<bool> *cancelled = nullptr)
+        : models_(std::move(models)),
+          prompt_(std::move(prompt)),
+          negative_prompt_(std::move(negative_prompt)),
+          steps_(steps),
+          cfg_(cfg),
+          seeds_(std::move(seeds)),
+          img_data_(std::move(img_data)),
+          scheduler_type_(scheduler_type),
+          ctx_(size, models_ ? models_->paths.text_embedding_size : default_text_embedding_size, use_cfg && timestepCondSize(models_.get(), size) == 0),
+          progress_callback_(std::move(progress_callback)),
+          result_callback_(std::move(result_callback)),
+          cancelled_(cancelled)
     {
-        throw std::runtime_error("VAE Encoder model not initialized");
+        if (!models_ || !models_->clip)
+        {
+            throw std::runtime_error("Models not initialized");
+        }
+        resolution_ = models_->resolution(size);
+        if (!resolution_)
+        {
+            throw std::invalid_argument("No UNet/VAE graphs loaded for size " + std::to_string(size));
+        }
+        if (img2img && !resolution_->vae_encoder)
+        {
+            throw std::runtime_error("VAE Encoder model not initialized");
+        }
+        if (prompt_.empty())
+        {
+            throw std::invalid_argument("Input prompt cannot be empty");
+        }
+        if (seeds_.empty())
+        {
+            throw std::invalid_argument("At least one seed is required");
+        }
+        if (size_t timestep_cond_size = timestepCondSize(models_.get(), size))
+        {
+            ctx_.unet_input.timestep_cond.resize(timestep_cond_size);
+            guidanceScaleEmbedding(cfg_, ctx_.unet_input.timestep_cond);
+        }
+        ctx_.img2img = img2img && img_data_.size() == ctx_.imageSize();
+        ctx_.use_safety_checker = models_->safety_checker_mnn != nullptr;
+        if (ctx_.img2img)
+        {
+            start_step_ = (int)(steps_ * (1 - denoise_strength));
+        }
+        // CLIP once, then per image: the UNet steps plus the VAE decode
+        int steps_per_image = steps_ - start_step_ + 1;
+        total_run_steps_ = 1 + steps_per_image * (int)seeds_.size();
     }
-    if (prompt.empty())
+
+    ~GenerationTask()
     {
-        throw std::invalid_argument("Input prompt cannot be empty");
+        releaseUnetTensors();
     }
-    try
+
+    // Size of the UNet's timestep_cond input, 0 without one. UNets that
+    // have it embed the guidance scale and run without the CFG batch.
+    static size_t timestepCondSize(const ModelApps *models, int size)
     {
-        auto start_time = std::chrono::high_resolution_clock::now();
-        int first_step_time_ms = 0;
-        int total_run_steps = steps + 2;
+        const ResolutionApps *resolution = models ? models->resolution(size) : nullptr;
+        return resolution && resolution->unet ? resolution->unet->unetTimestepCondSize() : 0;
+    }
 
-        int current_step = 0;
+    GenerationTask(const GenerationTask &) = delete;
+    GenerationTask &operator=(const GenerationTask &) = delete;
 
-        ClipInput clip_input;
-        UnetInput unet_input;
-        int batch_size = 1;
-        if (use_cfg)
+    // Runs the next stage: CLIP (and the img2img VAE encode), one UNet step,
+    // or one VAE decode. Returns false once every image has been handed to
+    // result_callback.
+    bool runNext()
+    {
+        try
+        {
+            switch (stage_)
+            {
+                case Stage::ENCODE:
+                    encode();
+                    break;
+                case Stage::DENOISE:
+                    denoiseStep();
+                    break;
+                case Stage::DECODE:
+                    decode();
+                    break;
+                case Stage::DONE:
+                    break;
+            }
+        }
+        catch (const GenerationCancelled &)
+        {
+            throw;
+        }
+        catch (const std::exception &e)
         {
-            batch_size = 2;
+            QNN_ERROR("Image generation error: %s", e.what());
+            throw;
         }
-        unet_input.latents.resize(batch_size * 4 * sample_size * sample_size);
-        unet_input.text_embedding.resize(batch_size * 77 * text_embedding_size);
-        unet_input.text_embedding_float.resize(batch_size * 77 * text_embedding_size);
+        return stage_ != Stage::DONE;
+    }
+
+    // UNet steps and VAE decodes still to run.
+    int remainingSteps() const
+    {
+        return total_run_steps_ - current_step_;
+    }
+
+private:
+    enum class Stage
+    {
+        ENCODE,
+        DENOISE,
+        DECODE,
+        DONE,
+    };
 
-        clip_input.input_ids = processPrompt(prompt, negative_prompt, 77, use_cfg);
+    void releaseUnetTensors()
+    {
+        resolution_->unet->releaseUnetTensors(ctx_);
+    }
 
-        if (StatusCode::SUCCESS != clipApp->executeClipGraphs(clip_input, unet_input, use_cfg))
+    void abortIfCancelled()
+    {
+        if (keep_going_ && !(cancelled_ && cancelled_->load()))
         {
-            throw std::runtime_error("CLIP execution failed");
+            return;
         }
-        current_step++;
-        if (progress_callback)
+        releaseUnetTensors();
+        throw GenerationCancelled();
+    }
+
+    void reportProgress(const float *latents)
+    {
+        current_step_++;
+        if (progress_callback_)
         {
-            progress_callback(current_step, total_run_steps);
+            keep_going_ = progress_callback_(current_step_, total_run_steps_, latents);
         }
+    }
 
-        UnetOutput unet_output;
-        unet_output.latents.resize(batch_size * 4 * sample_size * sample_size);
-        VaeDecoderInput vae_decoder_input;
-        vae_decoder_input.latents.resize(1 * 4 * sample_size * sample_size);
-        Picture vae_decoder_output;
-        vae_decoder_output.pixel_values.resize(1 * 3 * output_size * output_size);
-        vae_decoder_output.pixels.resize(1 * 3 * output_size * output_size);
+    void encode()
+    {
+        abortIfCancelled();
+        image_start_time_ = std::chrono::high_resolution_clock::now();
 
-        DPMSolverMultistepScheduler scheduler(1000, 0.00085f, 0.012f, "scaled_linear", 2, "epsilon", "leading");
-        scheduler.set_timesteps(steps);
+        std::string embedding_key = TextEmbeddingCache::makeKey(prompt_, negative_prompt_, ctx_.use_cfg, ctx_.text_embedding_size, models_->clip_identity);
+        auto cached_embedding = g_embeddingCache ? g_embeddingCache->get(embedding_key) : nullptr;
+        if (cached_embedding)
+        {
+            ctx_.unet_input.text_embedding.assign(cached_embedding->text_embedding.begin(), cached_embedding->text_embedding.end());
+        }
+        else
+        {
+            TraceSpan span("clip");
+            auto clip_start = std::chrono::high_resolution_clock::now();
+            std::vector<int> input_ids = processPrompt(*models_->tokenizer, ctx_, prompt_, negative_prompt_, 77);
 
-        Qnn_Tensor_t *inputs = nullptr;
-        Qnn_Tensor_t *outputs = nullptr;
-        xt::xarray<float> timesteps = scheduler.get_timesteps();
-        std::cout << timesteps << std::endl;
-        auto shape2 = std::vector<int>{2, 4, sample_size, sample_size};
-        auto shape = std::vector<int>{1, 4, sample_size, sample_size};
+            if (StatusCode::SUCCESS != models_->clip->executeClipGraphs(ctx_, input_ids))
+            {
+                throw std::runtime_error("CLIP execution failed");
+            }
+            double clip_ms = elapsedMs(clip_start, std::chrono::high_resolution_clock::now());
+            g_clipMs.observe(clip_ms);
+            g_latencyModel.observe(PipelineStage::CLIP, ctx_.use_cfg, clip_ms);
 
-        xt::random::seed(seed);
-        xt::xarray<float> latents = xt::random::randn<float>(shape);
+            if (g_embeddingCache)
+            {
+                auto embedding = std::make_shared<TextEmbedding>();
+                embedding->text_embedding.assign(ctx_.unet_input.text_embedding.begin(), ctx_.unet_input.text_embedding.end());
+                g_embeddingCache->put(embedding_key, std::move(embedding));
+            }
+        }
+        reportProgress(nullptr);
+        abortIfCancelled();
 
-        int start_step = 0;
-        if (img2img && img_data.size() == 3 * output_size * output_size)
+        // The init image does not depend on the seed, so it is encoded once.
+        if (ctx_.img2img)
         {
-            Picture vae_encoder_input;
-            vae_encoder_input.pixel_values.resize(1 * 3 * output_size * output_size);
-            memcpy(vae_encoder_input.pixel_values.data(), img_data.data(), 3 * output_size * output_size * sizeof(float));
-            VaeEncoderOutput vae_encoder_output;
-            vae_encoder_output.mean.resize(1 * 4 * sample_size * sample_size);
-            vae_encoder_output.std.resize(1 * 4 * sample_size * sample_size);
+            TraceSpan span("vae_encoder");
             auto start = std::chrono::high_resolution_clock::now();
-            if (StatusCode::SUCCESS != vaeEncoderApp->executeVaeEncoderGraphs(vae_encoder_input, vae_encoder_output))
+            if (StatusCode::SUCCESS != resolution_->vae_encoder->executeVaeEncoderGraphs(ctx_, img_data_.data()))
             {
                 throw std::runtime_error("VAE encoder execution failed");
             }
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            g_vaeEncodeMs.observe(elapsedMs(start, end));
+            g_latencyModel.observe(PipelineStage::VAE_ENCODE, ctx_.output_size, elapsedMs(start, end));
             std::cout << "VAE encoder runSession duration: " << duration.count() << "ms" << std::endl;
-            auto mean = xt::adapt(vae_encoder_output.mean, {1, 4, sample_size, sample_size});
-            auto std = xt::adapt(vae_encoder_output.std, {1, 4, sample_size, sample_size});
-            xt::xarray<float> noise_0 = xt::random::randn<float>(shape);
+        }
+        img_data_ = std::vector<float>();
+
+        startImage();
+    }
+
+    void startImage()
+    {
+        first_step_time_ms_ = 0;
+        scheduler_ = makeScheduler(scheduler_type_);
+        scheduler_->set_timesteps(steps_);
+        scheduler_->reserve(ctx_.latentSize());
+        scheduler_->seed(seeds_[image_index_]);
+
+        timesteps_ = scheduler_->get_timesteps();
+        std::cout << timesteps_ << std::endl;
+
+        auto shape = std::vector<int>{1, 4, ctx_.sample_size, ctx_.sample_size};
+        // The task's own engine: xtensor's default one is shared by every
+        // thread, and an image's latents must depend on its seed alone.
+        noise_engine_.seed(seeds_[image_index_]);
+        xt::xarray<float> latents = xt::random::randn<float>(shape, 0.0f, 1.0f, noise_engine_);
+
+        if (ctx_.img2img)
+        {
+            auto mean = xt::adapt(ctx_.vae_encoder_output.mean, shape);
+            auto std = xt::adapt(ctx_.vae_encoder_output.std, shape);
+            xt::xarray<float> noise_0 = xt::random::randn<float>(shape, 0.0f, 1.0f, noise_engine_);
             xt::xarray<float> img_latent_xt = xt::eval(mean + std * noise_0);
             xt::xarray<float> img_latent_scaled = xt::eval(0.18215 * img_latent_xt);
 
-            start_step = (int)(steps * (1 - denoise_strength));
-
-            total_run_steps -= start_step;
-            scheduler.set_begin_index(start_step);
-            std::vector<int> t = {(int)(timesteps[start_step])};
+            scheduler_->set_begin_index(start_step_);
+            std::vector<int> t = {(int)(timesteps_[start_step_])};
             xt::xarray<int> x_xt = xt::adapt(t, {1});
-            latents = xt::random::randn<float>(shape);
-            latents = scheduler.add_noise(img_latent_scaled, latents, x_xt);
+            latents = xt::random::randn<float>(shape, 0.0f, 1.0f, noise_engine_);
+            latents = scheduler_->add_noise(img_latent_scaled, latents, x_xt);
         }
-
-        for (int i = start_step; i < timesteps.size(); i++)
+        std::copy(latents.begin(), latents.end(), ctx_.latents.begin());
+        // Later steps get their UNet input from the scheduler step.
+        for (int batch = 0; batch < ctx_.batchSize(); batch++)
         {
-            auto start = std::chrono::high_resolution_clock::now();
-            xt::xarray<float> latents_input = xt::concatenate(xt::xtuple(latents, latents));
-            unet_input.latents = std::vector<float>(latents_input.begin(), latents_input.end());
-            unet_input.timestep = timesteps[i];
+            std::copy(latents.begin(), latents.end(), ctx_.unet_input.latents.begin() + batch * ctx_.latentSize());
+        }
 
-            if (i == start_step)
-            {
-                auto step_start = std::chrono::high_resolution_clock::now();
-                if (StatusCode::SUCCESS != unetApp->executeUnetGraphsFirst(unet_input, unet_output, inputs, outputs, use_cfg))
-                {
-                    throw std::runtime_error("UNET first step execution failed");
-                }
-                auto step_end = std::chrono::high_resolution_clock::now();
-                first_step_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(step_end - step_start).count();
-            }
-            else
-            {
-                if (StatusCode::SUCCESS != unetApp->executeUnetGraphsRemain(unet_input, unet_output, inputs, outputs, use_cfg))
-                {
-                    throw std::runtime_error("UNET step execution failed");
-                }
-            }
-            auto end = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-            std::cout << "UNET runSession duration: " << duration.count() << "ms" << std::endl;
+        step_ = start_step_;
+        stage_ = step_ < (int)timesteps_.size() ? Stage::DENOISE : Stage::DECODE;
+    }
+
+    // Works only on the buffers of ctx_, which are sized once per job, so
+    // a step does not allocate apart from the progress callback.
+    void denoiseStep()
+    {
+        abortIfCancelled();
+        int i = step_;
+        TraceSpan step_span("step", i);
+        auto start = std::chrono::high_resolution_clock::now();
+        ctx_.unet_input.timestep = timesteps_[i];
 
-            xt::xarray<float> noise_pred;
-            if (use_cfg)
+        {
+            TraceSpan unet_span("unet", i);
+            auto step_start = std::chrono::high_resolution_clock::now();
+            if (StatusCode::SUCCESS != resolution_->unet->executeUnetGraphs(ctx_))
             {
-                noise_pred = xt::adapt(unet_output.latents, shape2);
-                xt::xarray<float> noise_pred_uncond = xt::view(noise_pred, 0);
-                xt::xarray<float> noise_pred_text = xt::view(noise_pred, 1);
-                noise_pred = noise_pred_uncond + cfg * (noise_pred_text - noise_pred_uncond);
-                noise_pred = xt::eval(noise_pred);
+                throw std::runtime_error("UNET step execution failed");
             }
-            else
+            if (i == start_step_)
             {
-                noise_pred = xt::adapt(unet_output.latents, shape);
-                noise_pred = xt::eval(noise_pred);
+                auto step_end = std::chrono::high_resolution_clock::now();
+                first_step_time_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(step_end - step_start).count();
             }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        g_unetStepMs.observe(elapsedMs(start, end));
+        g_latencyModel.observe(PipelineStage::UNET_STEP, ctx_.output_size * 2 + ctx_.use_cfg, elapsedMs(start, end));
 
-            latents = scheduler.step(noise_pred, timesteps[i], latents).prev_sample;
-            auto end2 = std::chrono::high_resolution_clock::now();
-            auto duration2 = std::chrono::duration_cast<std::chrono::milliseconds>(end2 - end).count();
-            std::cout << "Scheduler step duration: " << duration2 << "ms" << std::endl;
+        {
+            // Guidance, the update and the next UNet input (every half of
+            // the CFG batch denoises the same latents) in one pass.
+            TraceSpan scheduler_span("scheduler", i);
+            const float *noise_pred_uncond = ctx_.unet_output.latents.data();
+            const float *noise_pred_text = ctx_.use_cfg ? noise_pred_uncond + ctx_.latentSize() : nullptr;
+            float *unet_inputs[] = {ctx_.unet_input.latents.data(), ctx_.unet_input.latents.data() + ctx_.latentSize()};
+            scheduler_->step(noise_pred_uncond, noise_pred_text, cfg_, timesteps_[i], ctx_.latents.data(), ctx_.latents.size(), unet_inputs, ctx_.batchSize());
+        }
+        auto end2 = std::chrono::high_resolution_clock::now();
+        g_schedulerStepMs.observe(elapsedMs(end, end2));
 
-            current_step++;
-            if (progress_callback)
-            {
-                progress_callback(current_step, total_run_steps);
-            }
-            auto end3 = std::chrono::high_resolution_clock::now();
-            auto duration3 = std::chrono::duration_cast<std::chrono::milliseconds>(end3 - end2).count();
-            std::cout << "callback duration: " << duration3 << "ms" << std::endl;
+        {
+            TraceSpan callback_span("progress_callback", i);
+            reportProgress(ctx_.latents.data());
+        }
+
+        step_++;
+        if (step_ >= (int)timesteps_.size())
+        {
+            stage_ = Stage::DECODE;
         }
+    }
+
+    void decode()
+    {
+        abortIfCancelled();
 
-        latents = xt::eval((1 / 0.18215) * latents);
-        vae_decoder_input.latents = std::vector<float>(latents.begin(), latents.end());
+        std::vector<float> pixel_values_data(ctx_.imageSize());
+        for (float &latent : ctx_.latents)
+        {
+            latent *= 1 / 0.18215f;
+        }
 
-        if (StatusCode::SUCCESS != vaeDecoderApp->executeVaeDecoderGraphs(vae_decoder_input, vae_decoder_output))
         {
-            throw std::runtime_error("VAE decoder execution failed");
+            TraceSpan vae_span("vae_decoder");
+            auto vae_start = std::chrono::high_resolution_clock::now();
+            if (StatusCode::SUCCESS != resolution_->vae_decoder->executeVaeDecoderGraphs(ctx_, ctx_.latents.data(), pixel_values_data.data()))
+            {
+                throw std::runtime_error("VAE decoder execution failed");
+            }
+            double vae_ms = elapsedMs(vae_start, std::chrono::high_resolution_clock::now());
+            g_vaeDecodeMs.observe(vae_ms);
+            g_latencyModel.observe(PipelineStage::VAE_DECODE, ctx_.output_size, vae_ms);
         }
 
-        auto pixel_values = xt::adapt(vae_decoder_output.pixel_values, {1, 3, output_size, output_size});
+        auto pixel_values = xt::adapt(pixel_values_data, {1, 3, ctx_.output_size, ctx_.output_size});
         auto image = xt::view(pixel_values, 0);
         auto transposed = xt::transpose(image, {1, 2, 0});
         auto normalized = xt::clip(((transposed + 1.0) / 2.0) * 255.0, 0.0, 255.0);
@@ -701,203 +1139,1564 @@ GenerationResult generateImage(
 
         std::vector<uint8_t> output_data(uint8_image.begin(), uint8_image.end());
 
-        unetApp->cleanUnetGraphs(inputs, outputs);
-
-        if (progress_callback)
-        {
-            progress_callback(total_run_steps, total_run_steps);
-        }
+        releaseUnetTensors();
+        reportProgress(nullptr);
 
+        // Wall time since the previous image (or the start), so it includes
+        // steps of other jobs interleaved with this one.
         auto end_time = std::chrono::high_resolution_clock::now();
-        auto total_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+        auto total_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - image_start_time_).count();
+        image_start_time_ = end_time;
 
-        if (use_safety_checker)
+        if (ctx_.use_safety_checker)
         {
             float nsfw_score = 0.0f;
-            if (safety_check(output_data, output_size, output_size, nsfw_score, safetyCheckerInterpreter, safetyCheckerSession))
+            bool checked;
+            {
+                TraceSpan safety_span("safety_check");
+                auto safety_start = std::chrono::high_resolution_clock::now();
+                checked = safety_check(output_data, ctx_.output_size, ctx_.output_size, nsfw_score, models_->safety_checker_mnn, models_->safety_checker_session);
+                double safety_ms = elapsedMs(safety_start, std::chrono::high_resolution_clock::now());
+                g_safetyCheckMs.observe(safety_ms);
+                g_latencyModel.observe(PipelineStage::SAFETY_CHECK, ctx_.output_size, safety_ms);
+            }
+            if (checked)
             {
-                if (nsfw_score > nsfw_threshold)
+                if (nsfw_score > ctx_.nsfw_threshold)
                 {
                     std::fill(output_data.begin(), output_data.end(), 255);
                 }
             }
         }
 
-        return GenerationResult{
-                output_data,
-                output_size, // width
-                output_size, // height
+        result_callback_(image_index_, GenerationResult{
+                std::move(output_data),
+                ctx_.output_size, // width
+                ctx_.output_size, // height
                 3,           // channels
                 static_cast<int>(total_time),
-                first_step_time_ms,
-        };
-    }
-    catch (const std::exception &e)
-    {
-        QNN_ERROR("Image generation error: %s", e.what());
-        throw;
+                first_step_time_ms_,
+        });
+
+        image_index_++;
+        if (image_index_ < seeds_.size())
+        {
+            startImage();
+        }
+        else
+        {
+            stage_ = Stage::DONE;
+        }
     }
-}
 
-int main(int argc, char **argv)
+    std::shared_ptr<ModelApps> models_;
+    // The graphs for the output size, owned by models_.
+    const ResolutionApps *resolution_ = nullptr;
+    const std::string prompt_;
+    const std::string negative_prompt_;
+    const int steps_;
+    const float cfg_;
+    const std::vector<unsigned> seeds_;
+    // Only needed until the VAE encode.
+    std::vector<float> img_data_;
+    const SchedulerType scheduler_type_;
+    GenerationContext ctx_;
+    ProgressCallback progress_callback_;
+    ResultCallback result_callback_;
+    const std::atomic<bool> *cancelled_;
+
+    Stage stage_ = Stage::ENCODE;
+    int start_step_ = 0;
+    int total_run_steps_ = 0;
+    int current_step_ = 0;
+    bool keep_going_ = true;
+    size_t image_index_ = 0;
+    int step_ = 0;
+    int first_step_time_ms_ = 0;
+    std::chrono::high_resolution_clock::time_point image_start_time_;
+
+    std::unique_ptr<Scheduler> scheduler_;
+    std::mt19937 noise_engine_;
+    xt::xarray<float> timesteps_;
+};
+
+enum class ResultMode
 {
-    using namespace qnn::tools;
+    INLINE, // base64 image inside the complete event
+    STORED, // complete event carries a result id, bytes served by GET /result/{id}
+};
 
-    if (!qnn::log::initializeLogging())
-    {
-        std::cerr << "ERROR: Unable to initialize logging!\n";
-        return EXIT_FAILURE;
+struct GenerationJob
+{
+    std::string prompt;
+    std::string negative_prompt;
+    int steps;
+    float cfg;
+    bool use_cfg;
+    std::vector<unsigned> seeds;
+    int size;
+    bool img2img;
+    std::vector<float> img_data;
+    float denoise_strength;
+    SchedulerType scheduler;
+    ResultMode result_mode;
+    ImageFormat format;
+    int quality;
+    int preview_every;
+    std::string id;
+    std::atomic<bool> cancelled{false};
+    EventChannel events;
+    // Guards closing events: images still in the encoder may be published
+    // after its generation task has finished.
+    std::mutex stream_mutex;
+    int pending_images = 0;
+    bool generation_done = false;
+    // Result store ids by image index, filled in as stored results land.
+    std::vector<std::string> result_ids;
+    // Result cache key per image index, empty when the cache is off.
+    std::vector<std::string> cache_keys;
+    // Submitted through /jobs: kept in the registry after it finishes and
+    // not cancelled when an event stream disconnects.
+    bool detached = false;
+    // Wall-clock budget from submission, 0 for none. steps is lowered to fit.
+    int deadline_ms = 0;
+    // Estimated run time, counted in g_backlogMs while the job is pending.
+    int64_t estimated_ms = 0;
+    std::chrono::steady_clock::time_point enqueued_at;
+};
+
+std::string sseEvent(const nlohmann::json &data)
+{
+    return "data: " + data.dump() + "\n\n";
+}
+
+// Closes the job's event stream once generation has ended and every image
+// handed to the encoder has been published, whichever happens last.
+void releaseJobStream(GenerationJob &job, bool generation_done)
+{
+    std::lock_guard<std::mutex> lock(job.stream_mutex);
+    if (generation_done)
+    {
+        job.generation_done = true;
+    }
+    else
+    {
+        job.pending_images--;
+    }
+    if (job.generation_done && job.pending_images == 0)
+    {
+        job.events.close();
+        g_jobsInFlight.sub();
+    }
+}
+
+std::shared_ptr<const StoredImage> makeStoredImage(std::vector<uint8_t> bytes, ImageFormat format, int width, int height, int channels)
+{
+    auto image = std::make_shared<StoredImage>();
+    image->data = std::move(bytes);
+    image->content_type = imageContentType(format);
+    image->width = width;
+    image->height = height;
+    image->channels = channels;
+    return image;
+}
+
+// Attaches the (possibly compressed) image to the complete event and
+// offers it to the result cache.
+void publishResult(
+        GenerationJob &job,
+        nlohmann::json complete,
+        std::shared_ptr<const StoredImage> image,
+        ImageFormat format,
+        ResultStore &resultStore)
+{
+    size_t index = complete["index"];
+    if (g_resultCache && index < job.cache_keys.size())
+    {
+        g_resultCache->put(job.cache_keys[index], image);
+    }
+    complete["format"] = imageFormatName(format);
+    if (job.result_mode == ResultMode::STORED)
+    {
+        std::string result_id = resultStore.put(image);
+        complete["result_id"] = result_id;
+        complete["result_url"] = "/result/" + result_id;
+        std::lock_guard<std::mutex> lock(job.stream_mutex);
+        if (job.result_ids.size() <= index)
+        {
+            job.result_ids.resize(index + 1);
+        }
+        job.result_ids[index] = result_id;
+    }
+    else
+    {
+        TraceSpan span("base64");
+        auto encode_start = std::chrono::high_resolution_clock::now();
+
+        complete["image"] = base64_encode(std::string(image->data.begin(), image->data.end()));
+
+        auto encode_end = std::chrono::high_resolution_clock::now();
+        auto encode_time = std::chrono::duration_cast<std::chrono::milliseconds>(encode_end - encode_start).count();
+
+        g_base64Ms.observe(elapsedMs(encode_start, encode_end));
+        std::cout << "Encoding time: " << encode_time << " ms" << std::endl;
+    }
+    job.events.push(sseEvent(complete));
+}
+
+// Canonical description of everything that determines one output image:
+// request parameters, the seed, the effective init image, the output
+// encoding, safety checker settings and the model files.
+std::string resultCacheKey(const GenerationJob &job, const ModelApps &models, unsigned seed)
+{
+    auto number = [](double value) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.9g", value);
+        return std::string(buf);
+    };
+    RequestHasher hasher;
+    hasher.add(job.prompt).add(job.negative_prompt);
+    hasher.add(std::to_string(job.steps)).add(number(job.cfg)).add(job.use_cfg ? "cfg" : "nocfg");
+    hasher.add(std::to_string(seed)).add(std::to_string(job.size));
+    hasher.add(schedulerTypeName(job.scheduler));
+    if (job.img2img && !job.img_data.empty())
+    {
+        hasher.add(number(job.denoise_strength));
+        hasher.add(job.img_data.data(), job.img_data.size() * sizeof(float));
+    }
+    else
+    {
+        hasher.add("txt2img");
+    }
+    hasher.add(imageFormatName(job.format));
+    hasher.add(job.format == ImageFormat::JPEG ? std::to_string(job.quality) : "");
+    hasher.add(models.safety_checker_mnn ? number(default_nsfw_threshold) : "nosafety");
+    hasher.add(models.identity);
+    return hasher.hex();
+}
+
+// Publishes the job's cached images and builds the task that generates the
+// rest, or returns nullptr if every image came from the result cache. Runs
+// on the inference worker thread with g_modelAppsMutex held. models is
+// nullptr while no model set is loaded.
+std::unique_ptr<GenerationTask> startGenerationJob(
+        const std::shared_ptr<GenerationJob> &job,
+        std::shared_ptr<ModelApps> models,
+        ResultStore &resultStore,
+        ImageEncoder &imageEncoder)
+{
+    if (!models)
+    {
+        throw std::runtime_error("No model loaded");
+    }
+
+    auto completeEvent = [job](size_t index, int width, int height, int channels, int generation_time_ms, int first_step_time_ms) {
+        return nlohmann::json{
+                {"type", "complete"},
+                {"index", index},
+                {"num_images", job->seeds.size()},
+                {"seed", job->seeds[index]},
+                {"steps", job->steps},
+                {"width", width},
+                {"height", height},
+                {"channels", channels},
+                {"generation_time_ms", generation_time_ms},
+                {"first_step_time_ms", first_step_time_ms},
+        };
+    };
+
+    // Cached images are published straight away; only the remaining
+    // seeds go through the pipeline.
+    std::vector<unsigned> seeds;
+    std::vector<size_t> seed_indices;
+    for (size_t index = 0; index < job->seeds.size(); index++)
+    {
+        std::shared_ptr<const StoredImage> cached;
+        if (g_resultCache)
+        {
+            job->cache_keys.push_back(resultCacheKey(*job, *models, job->seeds[index]));
+            cached = g_resultCache->get(job->cache_keys.back());
+        }
+        if (cached)
+        {
+            auto complete = completeEvent(index, cached->width, cached->height, cached->channels, 0, 0);
+            complete["cached"] = true;
+            publishResult(*job, std::move(complete), cached, job->format, resultStore);
+        }
+        else
+        {
+            seeds.push_back(job->seeds[index]);
+            seed_indices.push_back(index);
+        }
+    }
+    if (seeds.empty())
+    {
+        return nullptr;
     }
 
-    bool loadFromCachedBinary{true};
-    std::string clipPath, unetPath, vaeDecoderPath, vaeEncoderPath, safetyCheckerPath;
-    std::string tokenizerPath;
+    // The cache keys were the last use of the init image outside the task.
+    return std::make_unique<GenerationTask>(
+            std::move(models),
+            job->prompt,
+            job->negative_prompt,
+            job->steps,
+            job->cfg,
+            job->use_cfg,
+            std::move(seeds),
+            std::move(job->img_data),
+            job->denoise_strength,
+            job->size,
+            job->img2img,
+            job->scheduler,
+            [job, unet_steps = 0](int step, int total_steps, const float *latents) mutable {
+                nlohmann::json progress = {
+                        {"type", "progress"},
+                        {"step", step},
+                        {"total_steps", total_steps}
+                };
+                if (latents && job->preview_every > 0 && ++unet_steps % job->preview_every == 0)
+                {
+                    // 2x the latent resolution keeps this around 1 ms per preview
+                    int sample_size = job->size / 8;
+                    int preview_size = sample_size * 2;
+                    std::vector<uint8_t> preview;
+                    if (latent_preview_jpeg(latents, sample_size, sample_size, preview_size, 40, preview))
+                    {
+                        progress["preview"] = base64_encode(std::string(preview.begin(), preview.end()));
+                        progress["preview_size"] = preview_size;
+                    }
+                }
+                job->events.push(sseEvent(progress));
+                return !job->cancelled.load();
+            },
+            [job, &resultStore, &imageEncoder, completeEvent, seed_indices](size_t generated_index, GenerationResult result) {
+                g_imagesGenerated.inc();
+                size_t index = seed_indices[generated_index];
+                auto complete = completeEvent(index, result.width, result.height, result.channels, result.generation_time_ms, result.first_step_time_ms);
+
+                if (job->format == ImageFormat::RAW)
+                {
+                    auto image = makeStoredImage(std::move(result.image_data), ImageFormat::RAW, result.width, result.height, result.channels);
+                    publishResult(*job, std::move(complete), std::move(image), ImageFormat::RAW, resultStore);
+                    return;
+                }
 
-    auto res = sample_app::processCommandLine(argc, argv, loadFromCachedBinary, clipPath, unetPath, vaeEncoderPath, vaeDecoderPath, safetyCheckerPath, tokenizerPath);
+                {
+                    std::lock_guard<std::mutex> lock(job->stream_mutex);
+                    job->pending_images++;
+                }
+                EncodeRequest request;
+                request.pixels = std::move(result.image_data);
+                request.width = result.width;
+                request.height = result.height;
+                request.channels = result.channels;
+                request.format = job->format;
+                request.quality = job->quality;
+                request.done = [job, complete, &resultStore](bool ok, std::vector<uint8_t> &&encoded) {
+                    if (ok)
+                    {
+                        auto image = makeStoredImage(std::move(encoded), job->format, complete["width"], complete["height"], complete["channels"]);
+                        publishResult(*job, complete, std::move(image), job->format, resultStore);
+                    }
+                    else
+                    {
+                        nlohmann::json error = {
+                                {"type", "error"},
+                                {"index", complete["index"]},
+                                {"message", "Image encoding failed"}
+                        };
+                        job->events.push(sseEvent(error));
+                    }
+                    releaseJobStream(*job, false);
+                };
+                imageEncoder.submit(std::move(request));
+            },
+            &job->cancelled);
+}
 
+// Runs one stage of a job's generation; stage returns whether the job has
+// work left. Once it has none, or the stage threw, the job's final event has
+// been sent and its stream released, and false is returned.
+template <typename Stage>
+bool runJobStage(GenerationJob &job, Stage &&stage)
+{
     try
     {
-        auto blob = LoadBytesFromFile(tokenizerPath);
-        g_tokenizer = tokenizers::Tokenizer::FromBlobJSON(blob);
+        if (stage())
+        {
+            return true;
+        }
+        g_jobsCompleted.inc();
+    }
+    catch (const GenerationCancelled &)
+    {
+        g_jobsCancelled.inc();
+        std::cout << "Generation cancelled: " << job.id << std::endl;
+        nlohmann::json cancelled = {
+                {"type", "cancelled"}
+        };
+        job.events.push(sseEvent(cancelled));
     }
     catch (const std::exception &e)
     {
-        std::cerr << "Failed to load tokenizer or vocabulary: " << e.what() << std::endl;
-        return EXIT_FAILURE;
+        g_jobsFailed.inc();
+        nlohmann::json error = {
+                {"type", "error"},
+                {"message", e.what()}
+        };
+        job.events.push(sseEvent(error));
     }
+    releaseJobStream(job, true);
+    return false;
+}
+
+// A job the inference worker has taken off the queue and is interleaving
+// with the other active ones.
+struct ActiveJob
+{
+    std::shared_ptr<GenerationJob> job;
+    std::unique_ptr<GenerationTask> task;
 
-    auto safetyCheckerApp = res.safety_checker_mnn;
-    if (!safetyCheckerApp && use_safety_checker)
+    int remainingSteps() const
     {
-        std::cerr << "Failed to load Safety Checker MNN model" << std::endl;
-        return EXIT_FAILURE;
+        return task->remainingSteps();
+    }
+};
+
+// Warms up a model set on the inference worker before it is installed:
+// CLIP, steps UNet steps and one VAE decode on a dummy prompt at every
+// loaded size, so that HTP context activation, page faults on the context
+// binaries and IO tensor allocation happen before the first real request
+// and the latency model has samples to plan deadlines with. Each size gets
+// a pass without and one with CFG, which runs CLIP twice and doubles the
+// UNet batch, so both kinds of job can be planned from the start (UNets
+// with timestep_cond never use the CFG batch and get only one). runNext()
+// runs one pipeline stage, which the worker interleaves with those of
+// running jobs, so the warm-up never drives the accelerator from another
+// thread.
+class ModelWarmUp
+{
+public:
+    ModelWarmUp(std::shared_ptr<ModelApps> models, int steps)
+        : models_(std::move(models)),
+          steps_(steps)
+    {
+        if (models_ && steps_ > 0)
+        {
+            for (const auto &resolution : models_->resolutions)
+            {
+                passes_.push_back({resolution.first, false});
+                if (GenerationTask::timestepCondSize(models_.get(), resolution.first) == 0)
+                {
+                    passes_.push_back({resolution.first, true});
+                }
+            }
+        }
+    }
+
+    // Runs the next warm-up stage. Returns false once all are done.
+    bool runNext()
+    {
+        if (next_ == passes_.size())
+        {
+            return false;
+        }
+        const Pass &pass = passes_[next_];
+        try
+        {
+            if (!task_)
+            {
+                start_ = std::chrono::steady_clock::now();
+                task_ = std::make_unique<GenerationTask>(
+                        models_,
+                        "warmup",
+                        "",
+                        steps_,
+                        7.5f,
+                        pass.use_cfg,
+                        std::vector<unsigned>{0},
+                        std::vector<float>{},
+                        0.6f,
+                        pass.size,
+                        false,
+                        SchedulerType::DPM_SOLVER,
+                        nullptr,
+                        [](size_t, GenerationResult) {});
+            }
+            if (task_->runNext())
+            {
+                return true;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Warm-up at size " << pass.size << (pass.use_cfg ? " with CFG" : "") << " failed: " << e.what() << std::endl;
+        }
+        task_.reset();
+        std::cout << "Warm-up time at size " << pass.size << (pass.use_cfg ? " with CFG" : "") << ": " << std::llround(elapsedMs(start_, std::chrono::steady_clock::now())) << " ms" << std::endl;
+        next_++;
+        return next_ < passes_.size();
+    }
+
+    const std::shared_ptr<ModelApps> &models() const
+    {
+        return models_;
+    }
+
+private:
+    struct Pass
+    {
+        int size;
+        bool use_cfg;
+    };
+
+    std::shared_ptr<ModelApps> models_;
+    const int steps_;
+    std::vector<Pass> passes_;
+    size_t next_ = 0;
+    std::unique_ptr<GenerationTask> task_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Makes apps the model set new jobs start on (nullptr unloads). Takes
+// g_modelAppsMutex only for the exchange, so it lands between two stages.
+// Jobs already running finish on the set they started with, which is
+// released once the last of them is done.
+void swapModelApps(std::shared_ptr<ModelApps> apps)
+{
+    std::shared_ptr<ModelApps> previous;
+    {
+        std::lock_guard<std::mutex> lock(g_modelAppsMutex);
+        previous = std::atomic_exchange(&g_modelApps, std::move(apps));
+    }
+}
+
+// A model set handed to the inference worker to warm up and install.
+struct ModelInstall
+{
+    std::shared_ptr<ModelApps> apps;
+    int warmup_steps;
+    std::promise<void> installed;
+};
+
+std::mutex g_modelInstallMutex;
+std::unique_ptr<ModelInstall> g_pendingModelInstall;
+
+// Hands apps to the inference worker, which warms it up between the stages
+// of running jobs and then swaps it in. Returns once it is installed. One
+// install at a time: /models/load serializes them with modelLoadMutex.
+void installModelApps(std::shared_ptr<ModelApps> apps, int warmup_steps, BoundedJobQueue<std::shared_ptr<GenerationJob>> &jobQueue)
+{
+    auto install = std::make_unique<ModelInstall>();
+    install->apps = std::move(apps);
+    install->warmup_steps = warmup_steps;
+    std::future<void> installed = install->installed.get_future();
+    {
+        std::lock_guard<std::mutex> lock(g_modelInstallMutex);
+        g_pendingModelInstall = std::move(install);
+    }
+    jobQueue.interrupt();
+    installed.wait();
+}
+
+// Called by the inference worker between stages: takes the pending install,
+// if any.
+std::unique_ptr<ModelInstall> takeModelInstall()
+{
+    std::lock_guard<std::mutex> lock(g_modelInstallMutex);
+    return std::move(g_pendingModelInstall);
+}
+
+// Builds a job from a /generate or /jobs request body. Throws on invalid
+// input; the job is not registered or queued yet.
+std::shared_ptr<GenerationJob> parseGenerationRequest(const httplib::Request &req, ResultMode default_result_mode)
+{
+    // multipart/form-data carries the JSON fields in a "params" part
+    // and the init image as a binary "image" part, which is decoded
+    // in place instead of going through base64. "mask" parts are
+    // accepted but unused until the pipeline supports inpainting.
+    nlohmann::json json;
+    const httplib::MultipartFormData *image_part = nullptr;
+    if (req.is_multipart_form_data())
+    {
+        auto params = req.files.find("params");
+        json = params != req.files.end() ? nlohmann::json::parse(params->second.content) : nlohmann::json::object();
+        auto image = req.files.find("image");
+        if (image != req.files.end() && !image->second.content.empty())
+        {
+            image_part = &image->second;
+        }
+    }
+    else
+    {
+        json = nlohmann::json::parse(req.body);
+    }
+    if (!json.contains("prompt"))
+    {
+        throw std::invalid_argument("Missing required field: 'prompt'");
+    }
+    int steps = 20;
+    if (json.contains("steps"))
+    {
+        steps = json["steps"].get<int>();
+    }
+    float cfg = 7.5;
+    if (json.contains("cfg"))
+    {
+        cfg = json["cfg"].get<float>();
+    }
+    std::string negative_prompt = "";
+    if (json.contains("negative_prompt"))
+    {
+        negative_prompt = json["negative_prompt"].get<std::string>();
+    }
+    bool use_cfg = false;
+    if (json.contains("use_cfg"))
+    {
+        use_cfg = json["use_cfg"].get<bool>();
+    }
+    // Without an explicit size the default is used, or the smallest loaded
+    // size if the model set has no graphs for it.
+    auto models = std::atomic_load(&g_modelApps);
+    int size = default_output_size;
+    if (json.contains("size"))
+    {
+        size = json["size"].get<int>();
+        if (models && !models->resolution(size))
+        {
+            std::string sizes;
+            for (const auto &resolution : models->resolutions)
+            {
+                sizes += (sizes.empty() ? "" : ", ") + std::to_string(resolution.first);
+            }
+            throw std::invalid_argument("size must be one of the loaded sizes: " + sizes);
+        }
+    }
+    else if (models && !models->resolution(size) && !models->resolutions.empty())
+    {
+        size = models->resolutions.begin()->first;
+    }
+    bool use_img2img = false;
+    std::vector<float> img_float_data;
+    if (image_part || json.contains("image"))
+    {
+        use_img2img = true;
+        std::string base64_decoded;
+        const std::string *image_bytes = image_part ? &image_part->content : nullptr;
+        if (!image_bytes)
+        {
+            base64_decoded = base64_decode(json["image"].get_ref<const std::string &>());
+            image_bytes = &base64_decoded;
+        }
+        std::vector<uint8_t> decoded_image;
+        decode_image(reinterpret_cast<const uint8_t *>(image_bytes->data()), image_bytes->size(), decoded_image, size);
+        if (decoded_image.size() != 3 * size * size)
+        {
+            img_float_data.clear();
+        }
+        else
+        {
+            xt::xarray<uint8_t> img_xt = xt::adapt(decoded_image, {1, size, size, 3});
+            xt::xarray<float> img_data = xt::cast<float>(img_xt);
+            img_data = xt::eval(img_data / 255.0);
+            img_data = xt::transpose(img_data, {0, 3, 1, 2});
+            img_data = xt::eval(img_data * 2.0 - 1.0);
+            img_float_data = std::vector<float>(img_data.begin(), img_data.end());
+        }
+    }
+    float denoise_strength = 0.6;
+    if (json.contains("denoise_strength"))
+    {
+        denoise_strength = json["denoise_strength"].get<float>();
+    }
+    SchedulerType scheduler = SchedulerType::DPM_SOLVER;
+    if (json.contains("scheduler"))
+    {
+        auto name = json["scheduler"].get<std::string>();
+        if (!parseSchedulerType(name, scheduler))
+        {
+            throw std::invalid_argument("Invalid scheduler: " + name);
+        }
+    }
+    if (scheduler == SchedulerType::LCM && steps > lcm_original_inference_steps)
+    {
+        throw std::invalid_argument("lcm supports at most " + std::to_string(lcm_original_inference_steps) + " steps");
+    }
+    ResultMode result_mode = default_result_mode;
+    if (json.contains("result_mode"))
+    {
+        auto mode = json["result_mode"].get<std::string>();
+        if (mode == "stored")
+        {
+            result_mode = ResultMode::STORED;
+        }
+        else if (mode != "inline")
+        {
+            throw std::invalid_argument("Invalid result_mode: " + mode);
+        }
+    }
+    // An explicit format wins over the Accept header. Inline results
+    // stay raw RGB by default for existing clients.
+    ImageFormat format = result_mode == ResultMode::STORED ? ImageFormat::PNG : ImageFormat::RAW;
+    if (json.contains("format"))
+    {
+        auto name = json["format"].get<std::string>();
+        if (!parseImageFormat(name, format))
+        {
+            throw std::invalid_argument("Invalid format: " + name);
+        }
+    }
+    else if (req.has_header("Accept"))
+    {
+        negotiateImageFormat(req.get_header_value("Accept"), format);
+    }
+    int quality = 90;
+    if (json.contains("quality"))
+    {
+        quality = std::clamp(json["quality"].get<int>(), 1, 100);
+    }
+    int preview_every = 0;
+    if (json.contains("preview_every"))
+    {
+        preview_every = std::max(0, json["preview_every"].get<int>());
+    }
+    int deadline_ms = 0;
+    if (json.contains("deadline_ms"))
+    {
+        deadline_ms = json["deadline_ms"].get<int>();
+        if (deadline_ms <= 0)
+        {
+            throw std::invalid_argument("deadline_ms must be positive");
+        }
+    }
+    unsigned seed = hashSeed(std::chrono::system_clock::now().time_since_epoch().count());
+    if (json.contains("seed"))
+    {
+        seed = json["seed"].get<unsigned>();
+    }
+    // Explicit seeds win; otherwise num_images consecutive seeds
+    std::vector<unsigned> seeds;
+    if (json.contains("seeds"))
+    {
+        seeds = json["seeds"].get<std::vector<unsigned>>();
+    }
+    else
+    {
+        int num_images = 1;
+        if (json.contains("num_images"))
+        {
+            num_images = json["num_images"].get<int>();
+        }
+        if (num_images < 1 || num_images > max_images_per_request)
+        {
+            throw std::invalid_argument("num_images must be between 1 and " + std::to_string(max_images_per_request));
+        }
+        for (int i = 0; i < num_images; i++)
+        {
+            seeds.push_back(seed + i);
+        }
+    }
+    if (seeds.empty() || seeds.size() > max_images_per_request)
+    {
+        throw std::invalid_argument("seeds must hold between 1 and " + std::to_string(max_images_per_request) + " values");
     }
 
-    MNN::ScheduleConfig config_1;
-    config_1.type = MNN_FORWARD_CPU;
-    config_1.numThread = 4;
-    MNN::BackendConfig backendConfig;
-    backendConfig.memory = MNN::BackendConfig::Memory_Low;
-    backendConfig.power = MNN::BackendConfig::Power_High;
-    config_1.backendConfig = &backendConfig;
+    auto job = std::make_shared<GenerationJob>();
+    job->prompt = json["prompt"].get<std::string>();
+    job->negative_prompt = negative_prompt;
+    job->steps = steps;
+    job->cfg = cfg;
+    // The effective setting: UNets with a timestep_cond input embed the
+    // guidance scale and run without the CFG batch. The latency model keys
+    // on it both when estimating the job and when observing its stages.
+    job->use_cfg = use_cfg && GenerationTask::timestepCondSize(models.get(), size) == 0;
+    job->seeds = std::move(seeds);
+    job->size = size;
+    job->img2img = use_img2img;
+    job->img_data = std::move(img_float_data);
+    job->denoise_strength = denoise_strength;
+    job->scheduler = scheduler;
+    job->result_mode = result_mode;
+    job->format = format;
+    job->quality = quality;
+    job->preview_every = preview_every;
+    job->deadline_ms = deadline_ms;
+    return job;
+}
+
+using JobQueue = BoundedJobQueue<std::shared_ptr<GenerationJob>>;
 
-    MNN::ScheduleConfig config_2;
-    config_2.type = MNN_FORWARD_CPU;
-    config_2.numThread = 1;
-    config_2.backendConfig = &backendConfig;
+// Predicted run time of job with the given step count from the latency
+// model. Returns false until every stage involved has been observed. Image
+// encoding overlaps with the next image, so only the last one counts.
+bool estimateJobMs(const GenerationJob &job, int steps, double &ms)
+{
+    double clip, unet_step, vae_decode;
+    if (!g_latencyModel.estimate(PipelineStage::CLIP, job.use_cfg, clip) ||
+        !g_latencyModel.estimate(PipelineStage::UNET_STEP, job.size * 2 + job.use_cfg, unet_step) ||
+        !g_latencyModel.estimate(PipelineStage::VAE_DECODE, job.size, vae_decode))
+    {
+        return false;
+    }
+    bool use_img2img = job.img2img && !job.img_data.empty();
+    int unet_steps = steps;
+    ms = clip;
+    if (use_img2img)
+    {
+        double vae_encode;
+        if (!g_latencyModel.estimate(PipelineStage::VAE_ENCODE, job.size, vae_encode))
+        {
+            return false;
+        }
+        ms += vae_encode;
+        unet_steps = steps - (int)(steps * (1 - job.denoise_strength));
+    }
+    double per_image = unet_steps * unet_step + vae_decode;
+    double safety;
+    auto models = std::atomic_load(&g_modelApps);
+    if (models && models->safety_checker_mnn && g_latencyModel.estimate(PipelineStage::SAFETY_CHECK, job.size, safety))
+    {
+        per_image += safety;
+    }
+    ms += per_image * job.seeds.size();
+    double encode;
+    if (job.format != ImageFormat::RAW &&
+        g_latencyModel.estimate(PipelineStage::IMAGE_ENCODE, job.size * 4 + static_cast<int>(job.format), encode))
+    {
+        ms += encode;
+    }
+    return true;
+}
+
+// For a job with a deadline, lowers steps to the largest count that still
+// fits after the work already queued. Returns false (with estimate_ms set)
+// if not even one step fits. Without latency data the job runs unchanged.
+//
+// The backlog is the summed estimate of every queued and active job, not a
+// serial finish time: with up to max_active_jobs interleaved, the new job
+// shares the accelerator with the others. But the accelerator runs one
+// stage at a time and never idles while work is pending, so the job is done
+// once at most backlog + its own estimate has run, whatever the order.
+// That makes the bound conservative while jobs are interleaved.
+bool planDeadline(GenerationJob &job, double &estimate_ms)
+{
+    double backlog = static_cast<double>(g_backlogMs.load());
+    double estimate;
+    if (job.deadline_ms <= 0 || !estimateJobMs(job, job.steps, estimate))
+    {
+        return true;
+    }
+    int steps = job.steps;
+    while (steps > 1 && backlog + estimate > job.deadline_ms)
+    {
+        steps--;
+        estimateJobMs(job, steps, estimate);
+    }
+    estimate_ms = backlog + estimate;
+    if (estimate_ms > job.deadline_ms)
+    {
+        return false;
+    }
+    if (steps != job.steps)
+    {
+        std::cout << "Deadline " << job.deadline_ms << " ms: steps " << job.steps << " -> " << steps << std::endl;
+        job.steps = steps;
+    }
+    return true;
+}
 
-    if (use_safety_checker)
+// Registers and queues a parsed job. If its deadline cannot be met even
+// with one step the response is set to 422, on a full queue to 429, and
+// false is returned.
+bool enqueueJob(const std::shared_ptr<GenerationJob> &job, JobQueue &jobQueue, JobRegistry<GenerationJob> &jobRegistry, httplib::Response &res)
+{
+    double estimate_ms = 0;
+    if (!planDeadline(*job, estimate_ms))
     {
-        safetyCheckerSession = safetyCheckerApp->createSession(config_2);
+        g_jobsDeadlineRejected.inc();
+        nlohmann::json error = {
+                {"error", {
+                        {"message", "Deadline cannot be met"},
+                        {"type", "deadline_unreachable"},
+                        {"estimated_ms", std::llround(estimate_ms)}
+                }}
+        };
+        res.status = 422;
+        res.set_content(error.dump(), "application/json");
+        return false;
+    }
+    double estimate;
+    if (estimateJobMs(*job, job->steps, estimate))
+    {
+        job->estimated_ms = std::llround(estimate);
     }
 
-    auto clipApp = std::move(res.clip);
-    auto unetApp = std::move(res.unet);
-    auto vaeDecoderApp = std::move(res.vae_decoder);
-    auto vaeEncoderApp = std::move(res.vae_encoder);
+    job->id = jobRegistry.add(job);
+    job->enqueued_at = std::chrono::steady_clock::now();
 
-    auto status = initializeQnnApp(clipPath, clipApp, loadFromCachedBinary, "Clip");
-    if (status != EXIT_SUCCESS)
+    // Counted before the push: the worker may take the job and subtract its
+    // estimate before try_push even returns.
+    g_backlogMs += job->estimated_ms;
+    if (!jobQueue.try_push(job))
     {
-        return status;
+        g_backlogMs -= job->estimated_ms;
+        jobRegistry.remove(job->id);
+        g_jobsRejected.inc();
+        nlohmann::json error = {
+                {"error", {
+                        {"message", "Generation queue is full"},
+                        {"type", "queue_full"}
+                }}
+        };
+        res.status = 429;
+        res.set_header("Retry-After", "1");
+        res.set_content(error.dump(), "application/json");
+        return false;
     }
+    g_jobsInFlight.add();
+    return true;
+}
 
-    status = initializeQnnApp(unetPath, unetApp, loadFromCachedBinary, "Unet");
-    if (status != EXIT_SUCCESS)
+// Writes the job's events after last_event_id to an SSE sink until the
+// job's stream is closed, plus "queued" updates while it waits. Returns
+// false if the client went away first.
+bool streamJobEvents(const std::shared_ptr<GenerationJob> &job, const JobQueue &jobQueue, httplib::DataSink &sink, uint64_t last_event_id)
+{
+    int last_position = 0;
+    long long send_time = 0;
+    std::vector<EventChannel::Event> events;
+    while (!job->events.done(last_event_id))
     {
-        return status;
+        if (!sink.is_writable())
+        {
+            return false;
+        }
+        int position = jobQueue.position(job);
+        if (position > 0 && position != last_position)
+        {
+            nlohmann::json queued = {
+                    {"type", "queued"},
+                    {"position", position}
+            };
+            std::string queued_event = sseEvent(queued);
+            if (!sink.write(queued_event.c_str(), queued_event.size()))
+            {
+                return false;
+            }
+            last_position = position;
+        }
+        events.clear();
+        if (job->events.read(last_event_id, events, std::chrono::milliseconds(100)))
+        {
+            for (const auto &event : events)
+            {
+                TraceSpan span("sse.send");
+                auto send_start = std::chrono::high_resolution_clock::now();
+                std::string id = "id: " + std::to_string(event.id) + "\n";
+                if (!sink.write(id.c_str(), id.size()) || !sink.write(event.data->c_str(), event.data->size()))
+                {
+                    return false;
+                }
+                last_event_id = event.id;
+                auto send_end = std::chrono::high_resolution_clock::now();
+                send_time = std::chrono::duration_cast<std::chrono::milliseconds>(send_end - send_start).count();
+                g_sendMs.observe(elapsedMs(send_start, send_end));
+            }
+        }
     }
+    sink.write("data: [DONE]\n\n", 15);
+    std::cout << "Sending time: " << send_time << " ms" << std::endl;
+    return true;
+}
 
-    status = initializeQnnApp(vaeDecoderPath, vaeDecoderApp, loadFromCachedBinary, "VaeDecoder");
-    if (status != EXIT_SUCCESS)
+void sendNotFound(httplib::Response &res, const std::string &message)
+{
+    nlohmann::json error = {
+            {"error", {
+                    {"message", message},
+                    {"type", "not_found"}
+            }}
+    };
+    res.status = 404;
+    res.set_content(error.dump(), "application/json");
+}
+
+void sendStoredImage(httplib::Response &res, std::shared_ptr<const StoredImage> image)
+{
+    res.set_header("X-Image-Width", std::to_string(image->width));
+    res.set_header("X-Image-Height", std::to_string(image->height));
+    res.set_header("X-Image-Channels", std::to_string(image->channels));
+    res.set_content_provider(
+            image->data.size(),
+            image->content_type,
+            [image](size_t offset, size_t length, httplib::DataSink &sink) {
+                return sink.write(reinterpret_cast<const char *>(image->data.data()) + offset, length);
+            });
+}
+
+nlohmann::json modelPathsJson(const ModelPaths &paths)
+{
+    nlohmann::json resolutions = nlohmann::json::object();
+    for (const auto &resolution : paths.resolutions)
     {
-        return status;
+        resolutions[std::to_string(resolution.first)] = {
+                {"unet", resolution.second.unet},
+                {"vae_decoder", resolution.second.vae_decoder},
+                {"vae_encoder", resolution.second.vae_encoder}
+        };
     }
+    return {
+            {"clip", paths.clip},
+            {"resolutions", resolutions},
+            {"safety_checker", paths.safety_checker},
+            {"tokenizer", paths.tokenizer},
+            {"text_embedding_size", paths.text_embedding_size}
+    };
+}
 
-    if (img2img)
+// Applies the fields of a /models/load body to paths. Fields that are left
+// out keep their value; an empty vae_encoder or safety_checker turns that
+// model off. "resolutions" replaces every size, in the form modelPathsJson()
+// returns; "unet", "vae_decoder" and "vae_encoder" set the file of one size
+// using the [size:]path form of the command line. Throws on invalid input.
+ModelPaths parseModelPaths(const nlohmann::json &json, ModelPaths paths)
+{
+    if (!json.is_object())
+    {
+        throw std::invalid_argument("Expected a JSON object");
+    }
+    const std::pair<const char *, std::string *> fields[] = {
+            {"clip", &paths.clip},
+            {"safety_checker", &paths.safety_checker},
+            {"tokenizer", &paths.tokenizer}
+    };
+    for (const auto &field : fields)
+    {
+        if (json.contains(field.first))
+        {
+            *field.second = json[field.first].get<std::string>();
+        }
+    }
+    if (json.contains("resolutions"))
+    {
+        paths.resolutions.clear();
+        for (const auto &item : json["resolutions"].items())
+        {
+            int size = std::stoi(item.key());
+            if (size <= 0 || size % 8 != 0)
+            {
+                throw std::invalid_argument("Model sizes must be positive multiples of 8");
+            }
+            ResolutionPaths &resolution = paths.resolutions[size];
+            resolution.unet = item.value().value("unet", "");
+            resolution.vae_decoder = item.value().value("vae_decoder", "");
+            resolution.vae_encoder = item.value().value("vae_encoder", "");
+        }
+    }
+    const std::pair<const char *, std::string ResolutionPaths::*> sized_fields[] = {
+            {"unet", &ResolutionPaths::unet},
+            {"vae_decoder", &ResolutionPaths::vae_decoder},
+            {"vae_encoder", &ResolutionPaths::vae_encoder}
+    };
+    for (const auto &field : sized_fields)
+    {
+        if (json.contains(field.first))
+        {
+            int size;
+            std::string path;
+            if (!qnn::tools::sample_app::parseSizedModelPath(json[field.first].get<std::string>(), size, path))
+            {
+                throw std::invalid_argument("Model sizes must be positive multiples of 8");
+            }
+            paths.resolutions[size].*field.second = path;
+        }
+    }
+    if (paths.clip.empty() || paths.resolutions.empty() || paths.tokenizer.empty())
+    {
+        throw std::invalid_argument("clip, unet, vae_decoder and tokenizer must not be empty");
+    }
+    for (const auto &resolution : paths.resolutions)
     {
-        status = initializeQnnApp(vaeEncoderPath, vaeEncoderApp, loadFromCachedBinary, "VaeEncoder");
-        if (status != EXIT_SUCCESS)
+        if (resolution.second.unet.empty() || resolution.second.vae_decoder.empty())
         {
-            return status;
+            throw std::invalid_argument("Size " + std::to_string(resolution.first) + " needs both unet and vae_decoder");
         }
     }
+    return paths;
+}
 
-    httplib::Server svr;
+int main(int argc, char **argv)
+{
+    using namespace qnn::tools;
 
-    svr.Get("/health", [](const httplib::Request &req, httplib::Response &res)
-    { res.status = 200; });
+    if (!qnn::log::initializeLogging())
+    {
+        std::cerr << "ERROR: Unable to initialize logging!\n";
+        return EXIT_FAILURE;
+    }
 
-    svr.Post("/generate", [&clipApp, &unetApp, &vaeDecoderApp, &vaeEncoderApp, &safetyCheckerApp](const httplib::Request &req, httplib::Response &res)
+    sample_app::BackendOptions backendOptions;
+    sample_app::ModelPaths modelPaths;
+    sample_app::processCommandLine(argc, argv, backendOptions, modelPaths);
+
+    g_embeddingCache = std::make_unique<TextEmbeddingCache>(static_cast<size_t>(embedding_cache_mb) << 20);
+    Tracer::setEnabled(enable_trace);
+    if (result_cache_mb > 0)
     {
-        try {
-            auto json = nlohmann::json::parse(req.body);
-            if (!json.contains("prompt")) {
-                throw std::invalid_argument("Missing required field: 'prompt'");
-            }
-            int steps = 20;
-            if (json.contains("steps")) {
-                steps = json["steps"].get<int>();
-            }
-            float cfg = 7.5;
-            if (json.contains("cfg")) {
-                cfg = json["cfg"].get<float>();
-            }
-            std::string negative_prompt = "";
-            if (json.contains("negative_prompt")) {
-                negative_prompt = json["negative_prompt"].get<std::string>();
-            }
-            bool use_cfg = false;
-            if (json.contains("use_cfg")) {
-                use_cfg = json["use_cfg"].get<bool>();
-            }
-            int size = 512;
-            if (json.contains("size")) {
-                size = json["size"].get<int>();
-                output_size = size;
-                sample_size = size / 8;
-            }
-            img2img = false;
-            std::vector<float> img_float_data;
-            if (json.contains("image")) {
-                img2img = true;
-                auto image = json["image"].get<std::string>();
-                auto decoded = base64_decode(image);
-                auto decoded_buffer = std::vector<uint8_t>(decoded.begin(), decoded.end());
-                std::vector<uint8_t> decoded_image;
-                decode_image(decoded_buffer, decoded_image, output_size);
-                if (decoded_image.size() != 3 * output_size * output_size)
+        g_resultCache = std::make_unique<ResultCache>(static_cast<size_t>(result_cache_mb) << 20, result_cache_dir, static_cast<size_t>(result_cache_disk_mb) << 20);
+    }
+
+    if (!loadBackendLibraries(backendOptions))
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::string loadError;
+    auto initialModels = loadModelApps(backendOptions, modelPaths, nullptr, loadError);
+    if (!initialModels)
+    {
+        std::cerr << loadError << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    JobQueue jobQueue(queue_size);
+    ResultStore resultStore(result_store_size);
+    ImageEncoder imageEncoder(queue_size, 1, [](const EncodeRequest &request, double ms) {
+        g_imageEncodeMs.observe(ms);
+        g_latencyModel.observe(PipelineStage::IMAGE_ENCODE, request.width * 4 + static_cast<int>(request.format), ms);
+    });
+    JobRegistry<GenerationJob> jobRegistry(result_store_size);
+    std::thread inferenceWorker([&]()
+    {
+        // The initial set is installed like a /models/load one; /health
+        // reports ready once it is.
+        auto install = std::make_unique<ModelInstall>();
+        install->apps = std::move(initialModels);
+        install->warmup_steps = warmup_steps;
+        std::unique_ptr<ModelWarmUp> warmUp;
+
+        auto finishJob = [&](const GenerationJob &job)
+        {
+            g_backlogMs -= job.estimated_ms;
+            if (job.detached)
+            {
+                jobRegistry.finish(job.id);
+            }
+            else
+            {
+                jobRegistry.remove(job.id);
+            }
+        };
+
+        // Up to max_active_jobs jobs are taken off the queue and advanced
+        // one pipeline stage at a time, in the order the policy picks. The
+        // model lock is held per stage, so model swaps land between stages.
+        // A model set being installed gets one warm-up stage between two job
+        // stages; new jobs keep starting on the current set meanwhile, or
+        // wait for the new one if there is none.
+        StepScheduler<ActiveJob> active(schedule_policy);
+        while (true)
+        {
+            if (!install)
+            {
+                install = takeModelInstall();
+            }
+            if (install && !warmUp)
+            {
+                // Stage costs of the old models say nothing about the new
+                // ones. Stages of the old set that finish during the warm-up
+                // still land here, but the moving averages soon outweigh
+                // them.
+                g_latencyModel.clear();
+                warmUp = std::make_unique<ModelWarmUp>(install->apps, install->warmup_steps);
+            }
+
+            std::shared_ptr<GenerationJob> job;
+            bool can_start = !install || std::atomic_load(&g_modelApps);
+            while (can_start && active.size() < static_cast<size_t>(max_active_jobs) && (active.empty() && !install ? jobQueue.pop(job) : jobQueue.try_pop(job)))
+            {
+                g_queueWaitMs.observe(elapsedMs(job->enqueued_at, std::chrono::steady_clock::now()));
+                std::unique_ptr<GenerationTask> task;
+                bool started;
+                {
+                    std::lock_guard<std::mutex> lock(g_modelAppsMutex);
+                    started = runJobStage(*job, [&]() {
+                        task = startGenerationJob(job, g_modelApps, resultStore, imageEncoder);
+                        return task != nullptr;
+                    });
+                }
+                if (started)
                 {
-                    img_float_data.clear();
+                    g_jobsActive.add();
+                    active.add(ActiveJob{std::move(job), std::move(task)});
                 }
                 else
                 {
-                    xt::xarray<uint8_t> img_xt = xt::adapt(decoded_image, {1, output_size, output_size, 3});
-                    xt::xarray<float> img_data = xt::cast<float>(img_xt);
-                    img_data = xt::eval(img_data / 255.0);
-                    img_data = xt::transpose(img_data, {0, 3, 1, 2});
-                    img_data = xt::eval(img_data * 2.0 - 1.0);
-                    img_float_data = std::vector<float>(img_data.begin(), img_data.end());
+                    finishJob(*job);
+                }
+                job.reset();
+            }
+
+            if (install && !warmUp->runNext())
+            {
+                swapModelApps(std::move(install->apps));
+                install->installed.set_value();
+                install.reset();
+                warmUp.reset();
+                g_ready = true;
+            }
+            if (active.empty())
+            {
+                // pop() also returns false when interrupted for an install.
+                if (!install && jobQueue.closed() && jobQueue.size() == 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            size_t index = active.pick();
+            ActiveJob &entry = active[index];
+            bool more;
+            {
+                std::lock_guard<std::mutex> lock(g_modelAppsMutex);
+                more = runJobStage(*entry.job, [&]() { return entry.task->runNext(); });
+                if (!more)
+                {
+                    // Releases the UNet tensors while the models are locked.
+                    entry.task.reset();
                 }
             }
-            float denoise_strength = 0.6;
-            if (json.contains("denoise_strength")) {
-                denoise_strength = json["denoise_strength"].get<float>();
+            if (!more)
+            {
+                g_jobsActive.sub();
+                finishJob(*entry.job);
+            }
+            active.ran(index, !more);
+        }
+    });
+
+    httplib::Server svr;
+
+    // 503 until the warm-up pass is done so clients keep polling instead of
+    // sending their first request into a cold pipeline. After /models/unload
+    // it stays 503 until a model set is loaded again.
+    svr.Get("/health", [](const httplib::Request &req, httplib::Response &res)
+    {
+        if (!g_ready) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content("{\"status\":\"warming\"}", "application/json");
+            return;
+        }
+        if (!std::atomic_load(&g_modelApps)) {
+            res.status = 503;
+            res.set_content("{\"status\":\"unloaded\"}", "application/json");
+            return;
+        }
+        res.status = 200;
+        res.set_content("{\"status\":\"ok\"}", "application/json");
+    });
+
+    g_metrics.gauge("sd_queue_depth", "Jobs waiting for the inference worker.", [&jobQueue]() { return static_cast<double>(jobQueue.size()); });
+
+    svr.Get("/metrics", [](const httplib::Request &req, httplib::Response &res)
+    {
+        res.set_content(g_metrics.render(), "text/plain; version=0.0.4");
+    });
+
+    // Chrome trace-event JSON of the most recent spans; load it in
+    // chrome://tracing or ui.perfetto.dev. Empty unless started with --trace.
+    svr.Get("/debug/trace", [](const httplib::Request &req, httplib::Response &res)
+    {
+        size_t last = 10000;
+        if (req.has_param("last")) {
+            try {
+                last = std::stoul(req.get_param_value("last"));
+            } catch (const std::exception &) {
+                nlohmann::json error = {
+                        {"error", {
+                                {"message", "Invalid 'last' parameter"},
+                                {"type", "server_error"}
+                        }}
+                };
+                res.status = 400;
+                res.set_content(error.dump(), "application/json");
+                return;
+            }
+        }
+        res.set_content(Tracer::instance().dumpChromeTrace(last), "application/json");
+    });
+
+    svr.Get("/stats", [](const httplib::Request &req, httplib::Response &res)
+    {
+        nlohmann::json stats = {
+                {"text_embedding_cache", {
+                        {"hits", g_embeddingCache->hits()},
+                        {"misses", g_embeddingCache->misses()},
+                        {"entries", g_embeddingCache->entries()},
+                        {"bytes", g_embeddingCache->bytes()},
+                        {"max_bytes", g_embeddingCache->max_bytes()}
+                }},
+                {"scheduler", {
+                        {"policy", schedulePolicyName(schedule_policy)},
+                        {"max_active_jobs", max_active_jobs},
+                        {"active_jobs", g_jobsActive.value()}
+                }}
+        };
+        if (g_resultCache) {
+            stats["result_cache"] = {
+                    {"hits", g_resultCache->hits()},
+                    {"misses", g_resultCache->misses()},
+                    {"entries", g_resultCache->entries()},
+                    {"bytes", g_resultCache->bytes()},
+                    {"disk_bytes", g_resultCache->disk_bytes()}
+            };
+        }
+        res.set_content(stats.dump(), "application/json");
+    });
+
+    svr.Get("/models", [](const httplib::Request &req, httplib::Response &res)
+    {
+        auto models = std::atomic_load(&g_modelApps);
+        nlohmann::json status = {
+                {"loaded", models != nullptr}
+        };
+        if (models) {
+            status["models"] = modelPathsJson(models->paths);
+        }
+        res.set_content(status.dump(), "application/json");
+    });
+
+    // Swaps the served model set in place instead of restarting the
+    // process. The new set is loaded on this thread, then warmed up by the
+    // worker between stages of the jobs it keeps running on the old one, and
+    // swapped in after that. Jobs already running keep the set they started
+    // on. Fields missing from the body keep their current value.
+    std::mutex modelLoadMutex;
+    auto sendLoadInProgress = [](httplib::Response &res) {
+        nlohmann::json error = {
+                {"error", {
+                        {"message", "A model load is already in progress"},
+                        {"type", "load_in_progress"}
+                }}
+        };
+        res.status = 409;
+        res.set_content(error.dump(), "application/json");
+    };
+
+    svr.Post("/models/load", [&](const httplib::Request &req, httplib::Response &res)
+    {
+        std::unique_lock<std::mutex> loading(modelLoadMutex, std::try_to_lock);
+        if (!loading.owns_lock()) {
+            sendLoadInProgress(res);
+            return;
+        }
+        auto current = std::atomic_load(&g_modelApps);
+        ModelPaths paths;
+        try {
+            auto json = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body);
+            paths = parseModelPaths(json, current ? current->paths : modelPaths);
+        } catch (const std::exception& e) {
+            nlohmann::json error = {
+                    {"error", {
+                            {"message", e.what()},
+                            {"type", "server_error"}
+                    }}
+            };
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::string error_message;
+        auto models = loadModelApps(backendOptions, paths, current.get(), error_message);
+        // Do not keep the old set alive past the swap.
+        current.reset();
+        if (!models) {
+            nlohmann::json error = {
+                    {"error", {
+                            {"message", error_message},
+                            {"type", "server_error"}
+                    }}
+            };
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        installModelApps(std::move(models), warmup_steps, jobQueue);
+        nlohmann::json response = {
+                {"status", "loaded"},
+                {"models", modelPathsJson(paths)},
+                {"load_time_ms", std::llround(elapsedMs(start, std::chrono::steady_clock::now()))}
+        };
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // Detaches the models between two pipeline stages. Jobs already running
+    // keep their own reference and finish on them, and the set is freed
+    // when the last of them is done; queued jobs fail with "No model loaded"
+    // until the next /models/load.
+    svr.Post("/models/unload", [&](const httplib::Request &req, httplib::Response &res)
+    {
+        std::unique_lock<std::mutex> loading(modelLoadMutex, std::try_to_lock);
+        if (!loading.owns_lock()) {
+            sendLoadInProgress(res);
+            return;
+        }
+        swapModelApps(nullptr);
+        res.set_content("{\"status\":\"unloaded\"}", "application/json");
+    });
+
+    svr.Get("/result/:id", [&resultStore](const httplib::Request &req, httplib::Response &res)
+    {
+        auto image = resultStore.get(req.path_params.at("id"));
+        if (!image) {
+            sendNotFound(res, "Result not found");
+            return;
+        }
+        sendStoredImage(res, image);
+    });
+
+    svr.Post("/cancel/:id", [&jobRegistry](const httplib::Request &req, httplib::Response &res)
+    {
+        auto job = jobRegistry.find(req.path_params.at("id"));
+        if (!job) {
+            sendNotFound(res, "Job not found");
+            return;
+        }
+        job->cancelled = true;
+        nlohmann::json response = {
+                {"job_id", job->id},
+                {"cancelled", true}
+        };
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // Detached variant of /generate: returns the job id right away. Progress
+    // is read from /jobs/{id}/events, which can be reconnected at any time,
+    // and results default to the result store.
+    svr.Post("/jobs", [&jobQueue, &jobRegistry](const httplib::Request &req, httplib::Response &res)
+    {
+        try {
+            auto job = parseGenerationRequest(req, ResultMode::STORED);
+            job->detached = true;
+            if (!enqueueJob(job, jobQueue, jobRegistry, res)) {
+                return;
+            }
+            nlohmann::json response = {
+                    {"job_id", job->id},
+                    {"events_url", "/jobs/" + job->id + "/events"},
+                    {"result_url", "/jobs/" + job->id + "/result"},
+                    {"num_images", job->seeds.size()},
+                    {"steps", job->steps}
+            };
+            res.status = 202;
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            nlohmann::json error = {
+                    {"error", {
+                            {"message", e.what()},
+                            {"type", "server_error"}
+                    }}
+            };
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+        }
+    });
+
+    // SSE stream of a job's events. Every event carries an id; a client that
+    // reconnects with Last-Event-ID gets only what it missed. Disconnecting
+    // does not cancel the job.
+    svr.Get("/jobs/:id/events", [&jobQueue, &jobRegistry](const httplib::Request &req, httplib::Response &res)
+    {
+        auto job = jobRegistry.find(req.path_params.at("id"));
+        if (!job) {
+            sendNotFound(res, "Job not found");
+            return;
+        }
+        uint64_t last_event_id = 0;
+        if (req.has_header("Last-Event-ID")) {
+            try {
+                last_event_id = std::stoull(req.get_header_value("Last-Event-ID"));
+            } catch (const std::exception &) {
+                last_event_id = 0;
+            }
+        }
+
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("Connection", "keep-alive");
+        res.set_chunked_content_provider(
+                "text/event-stream",
+                [job, &jobQueue, last_event_id](size_t, httplib::DataSink& sink) -> bool {
+                    streamJobEvents(job, jobQueue, sink, last_event_id);
+                    return false;
+                });
+    });
+
+    svr.Get("/jobs/:id/result", [&jobRegistry, &resultStore](const httplib::Request &req, httplib::Response &res)
+    {
+        auto job = jobRegistry.find(req.path_params.at("id"));
+        if (!job) {
+            sendNotFound(res, "Job not found");
+            return;
+        }
+        size_t index = 0;
+        if (req.has_param("index")) {
+            try {
+                index = std::stoul(req.get_param_value("index"));
+            } catch (const std::exception &) {
+                index = job->seeds.size();
             }
-            unsigned seed = hashSeed(std::chrono::system_clock::now().time_since_epoch().count());
-            if (json.contains("seed")) {
-                seed = json["seed"].get<unsigned>();
+        }
+        if (index >= job->seeds.size()) {
+            nlohmann::json error = {
+                    {"error", {
+                            {"message", "Invalid image index"},
+                            {"type", "server_error"}
+                    }}
+            };
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        std::string result_id;
+        {
+            std::lock_guard<std::mutex> lock(job->stream_mutex);
+            if (index < job->result_ids.size()) {
+                result_id = job->result_ids[index];
             }
-            std::cout<<"prompt: "<<json["prompt"].get<std::string>()<<std::endl;
-            std::cout<<"negative_prompt: "<<negative_prompt<<std::endl;
-            std::cout<<"steps: "<<steps<<std::endl;
-            std::cout<<"cfg: "<<cfg<<std::endl;
-            std::cout<<"use_cfg: "<<use_cfg<<std::endl;
-            std::cout<<"seed: "<<seed<<std::endl;
-            std::cout<<"size: "<<size<<std::endl;
-            std::cout<<"denoise_strength: "<<denoise_strength<<std::endl;
+        }
+        if (result_id.empty()) {
+            if (job->events.closed()) {
+                sendNotFound(res, "Job finished without a stored result for this index");
+                return;
+            }
+            nlohmann::json pending = {
+                    {"job_id", job->id},
+                    {"status", "pending"}
+            };
+            res.status = 202;
+            res.set_header("Retry-After", "1");
+            res.set_content(pending.dump(), "application/json");
+            return;
+        }
+        auto image = resultStore.get(result_id);
+        if (!image) {
+            sendNotFound(res, "Result expired");
+            return;
+        }
+        sendStoredImage(res, image);
+    });
 
-            std::string prompt = json["prompt"].get<std::string>();
+    svr.Post("/generate", [&jobQueue, &jobRegistry](const httplib::Request &req, httplib::Response &res)
+    {
+        try {
+            auto job = parseGenerationRequest(req, ResultMode::INLINE);
+            if (!enqueueJob(job, jobQueue, jobRegistry, res)) {
+                return;
+            }
 
             res.set_header("Content-Type", "text/event-stream");
             res.set_header("Cache-Control", "no-cache");
@@ -905,76 +2704,20 @@ int main(int argc, char **argv)
 
             res.set_chunked_content_provider(
                     "text/event-stream",
-                    [prompt, negative_prompt, steps, cfg, use_cfg, seed, img_float_data, denoise_strength, &clipApp, &unetApp, &vaeDecoderApp, &vaeEncoderApp, &safetyCheckerApp]
-                            (size_t, httplib::DataSink& sink) -> bool {
-                        try {
-                            auto result = generateImage(
-                                    prompt,
-                                    negative_prompt,
-                                    steps,
-                                    cfg,
-                                    use_cfg,
-                                    seed,
-                                    img_float_data,
-                                    denoise_strength,
-                                    clipApp.get(),
-                                    unetApp.get(),
-                                    vaeDecoderApp.get(),
-                                    vaeEncoderApp.get(),
-                                    safetyCheckerApp,
-                                    [&sink](int step, int total_steps) {
-                                        nlohmann::json progress = {
-                                                {"type", "progress"},
-                                                {"step", step},
-                                                {"total_steps", total_steps}
-                                        };
-                                        std::string event = "data: " + progress.dump() + "\n\n";
-                                        sink.write(event.c_str(), event.size());
-                                    });
-
-                            auto encode_start = std::chrono::high_resolution_clock::now();
-
-                            std::string encoded = base64_encode(
-                                    std::string(result.image_data.begin(), result.image_data.end())
-                            );
-
-                            auto encode_end = std::chrono::high_resolution_clock::now();
-                            auto encode_time = std::chrono::duration_cast<std::chrono::milliseconds>(encode_end - encode_start).count();
-
-                            std::cout << "Encoding time: " << encode_time << " ms" << std::endl;
-
-                            auto send_start = std::chrono::high_resolution_clock::now();
-
-                            nlohmann::json complete = {
-                                    {"type", "complete"},
-                                    {"image", encoded},
-                                    {"seed", seed},
-                                    {"width", result.width},
-                                    {"height", result.height},
-                                    {"channels", result.channels},
-                                    {"generation_time_ms", result.generation_time_ms},
-                                    {"first_step_time_ms", result.first_step_time_ms},
-                            };
-
-                            std::string event = "data: " + complete.dump() + "\n\n";
-                            sink.write(event.c_str(), event.size());
-                            sink.write("data: [DONE]\n\n", 15);
-                            auto send_end = std::chrono::high_resolution_clock::now();
-                            auto send_time = std::chrono::duration_cast<std::chrono::milliseconds>(send_end - send_start).count();
-                            std::cout << "Sending time: " << send_time << " ms" << std::endl;
-
-                            return false;
-
-                        } catch (const std::exception& e) {
-                            nlohmann::json error = {
-                                    {"type", "error"},
-                                    {"message", e.what()}
-                            };
-                            std::string event = "data: " + error.dump() + "\n\n";
-                            sink.write(event.c_str(), event.size());
-                            sink.write("data: [DONE]\n\n", 15);
-                            return false;
+                    [job, &jobQueue](size_t, httplib::DataSink& sink) -> bool {
+                        nlohmann::json accepted = {
+                                {"type", "accepted"},
+                                {"job_id", job->id},
+                                {"steps", job->steps}
+                        };
+                        std::string accepted_event = sseEvent(accepted);
+                        // A failed write or a dead socket means the client went
+                        // away: cancel the job so the worker stops at its next check.
+                        if (!sink.write(accepted_event.c_str(), accepted_event.size()) ||
+                            !streamJobEvents(job, jobQueue, sink, 0)) {
+                            job->cancelled = true;
                         }
+                        return false;
                     });
 
         } catch (const std::exception& e) {
@@ -988,19 +2731,46 @@ int main(int argc, char **argv)
             res.set_content(error.dump(), "application/json");
         } });
 
-    svr.listen(listen_address, port);
-
-    if (sg_backendHandle_clip)
+    if (unix_socket_path.empty())
     {
-        pal::dynamicloading::dlClose(sg_backendHandle_clip);
+        svr.listen(listen_address, port);
     }
-    if (sg_backendHandle_unet)
+    else
     {
-        pal::dynamicloading::dlClose(sg_backendHandle_unet);
+        // Serve only on the socket file, readable and writable by our uid
+        // alone. Linux creates the file with the mode of the unbound socket,
+        // so the fchmod() before bind() makes it private from the start
+        // without touching the process-wide umask other threads create
+        // files under; the chmod() afterwards enforces it everywhere else.
+        // A leftover socket from a previous run is replaced.
+        unlink(unix_socket_path.c_str());
+        svr.set_address_family(AF_UNIX);
+        svr.set_socket_options([](socket_t sock) {
+            httplib::default_socket_options(sock);
+            fchmod(sock, S_IRUSR | S_IWUSR);
+        });
+        // httplib ignores the port for AF_UNIX but treats 0 as "pick one"
+        // and then fails to read it back, so pass the configured one.
+        bool bound = svr.bind_to_port(unix_socket_path, port);
+        if (!bound || chmod(unix_socket_path.c_str(), S_IRUSR | S_IWUSR) != 0)
+        {
+            std::cerr << "Failed to bind unix socket: " << unix_socket_path << std::endl;
+            jobQueue.close();
+            inferenceWorker.join();
+            return EXIT_FAILURE;
+        }
+        std::cout << "Listening on unix socket: " << unix_socket_path << std::endl;
+        svr.listen_after_bind();
+        unlink(unix_socket_path.c_str());
     }
-    if (sg_backendHandle_vae_decoder)
+
+    jobQueue.close();
+    inferenceWorker.join();
+    swapModelApps(nullptr);
+
+    if (sg_backendHandle)
     {
-        pal::dynamicloading::dlClose(sg_backendHandle_vae_decoder);
+        pal::dynamicloading::dlClose(sg_backendHandle);
     }
     if (sg_modelHandle)
     {
@@ -0,0 +1,136 @@
+// Generated by gen_unipc_reference.py from the diffusers transcription.
+// Do not edit.
+#ifndef UNIPCREFERENCE_HPP
+#define UNIPCREFERENCE_HPP
+
+namespace unipc_reference {
+
+// The samples after every step, starting from
+// x_i = 0.3 * 14 * sin(i + 1), with eps_i = sin(0.01 t + 0.1 x_i + i)
+// as the model output.
+constexpr int kSampleSize = 8;
+
+constexpr int kOrder2Steps10Timesteps[] = {900, 810, 720, 630, 540, 450, 360, 270, 180, 90};
+constexpr double kOrder2Steps10Samples[][kSampleSize] = {
+    {5.4179177500275797, 6.3467892291995884, 1.4642376825247809, -4.4825432984471476, -6.2358435085028763, -2.344509303687965, 4.0303595771733276, 6.7738225233626519},
+    {7.296949193520688, 9.1581810557582752, 2.3634986093556578, -6.0060272321945094, -8.2932353017442697, -3.2849347219034808, 5.2225377414607781, 9.6432243718589383},
+    {9.5487598484326064, 12.265588894438253, 3.0310846572291363, -8.4097494709144023, -11.113698647688624, -3.9911131179842463, 6.8291589017838739, 12.857193196871728},
+    {12.247668609108786, 15.62878820345305, 3.5537581997924823, -11.449035293434802, -14.868220487083384, -4.8571499371507354, 8.9177830655875248, 16.387584490297556},
+    {15.221376699362652, 19.109217173915994, 4.1387679215977604, -14.348209667227779, -18.856083917103479, -6.084682287366685, 11.273623569904933, 20.072488946651244},
+    {18.240131430973921, 22.529834705668979, 4.9003780429757686, -16.733199573874462, -22.265976122654415, -7.5503406980443923, 13.649863726329245, 23.708136489544007},
+    {21.076577450187074, 25.719939412186623, 5.7851644490815906, -18.817887729416597, -25.079250549673088, -8.8887913766283742, 15.818561814714421, 27.10061142683605},
+    {23.522199444345688, 28.536117397225755, 6.6460016160291406, -20.804685025626735, -27.602348429131979, -9.8036957071354234, 17.585637749693497, 30.087529252460413},
+    {25.411507192660878, 30.884275233291859, 7.3298948452942785, -22.658761526358802, -29.903290674284644, -10.267001342001944, 18.817059741198637, 32.561540423663558},
+    {26.785394836136135, 32.747924384084499, 7.8504303725193605, -24.119897811217978, -31.711453955173432, -10.466687228153402, 19.571573720916987, 34.517643389342759},
+};
+
+constexpr int kOrder2Steps20Timesteps[] = {940, 893, 846, 799, 752, 705, 658, 611, 564, 517, 470, 423, 376, 329, 282, 235, 188, 141, 94, 47};
+constexpr double kOrder2Steps20Samples[][kSampleSize] = {
+    {4.6322148731200565, 5.1854971151724811, 1.0173807398930201, -3.9497742358009296, -5.2930575158138957, -1.7907023505003563, 3.5353464005035091, 5.5937766770199397},
+    {5.7520797102298973, 6.7378805775066466, 1.5717395137701802, -4.6641166704420476, -6.4970872777731152, -2.4886582916314235, 4.2620980246426097, 7.1976521102328004},
+    {6.9859589136609612, 8.4759482112908309, 2.15439183650482, -5.5306901806391355, -7.8119824581944348, -3.1680537958673174, 5.0602309036687609, 8.9921303260144061},
+    {8.340946969795084, 10.390019912284075, 2.7416197028574953, -6.6014214994990184, -9.2964069822531332, -3.8120300762972192, 5.9500489873510576, 10.96989644609514},
+    {9.8136618032446794, 12.463242941088007, 3.3169003217738471, -7.903084634044494, -11.002735574674302, -4.4308952048201355, 6.9400362593606424, 13.11445772627042},
+    {11.404286813643424, 14.674525426686428, 3.8672085234706342, -9.4359535118139508, -12.972352137753743, -5.050566704889162, 8.041697885539989, 15.406257995160622},
+    {13.108065248147323, 16.998048286523609, 4.3901042678047615, -11.152761390438119, -15.19909694506212, -5.7065681684900325, 9.2584717004502881, 17.820359827846911},
+    {14.911395046657866, 19.402812728008602, 4.8936971046467912, -12.966239214325235, -17.612489987119321, -6.4325189660994706, 10.581576256628685, 20.325391351763283},
+    {16.792542051237856, 21.853351005010246, 5.3922208549491915, -14.781744914426893, -20.096335859672298, -7.2480417616623107, 11.991655224812707, 22.884520659737994},
+    {18.723477716814266, 24.311283033902388, 5.9005774565089908, -16.531230114865984, -22.536563802282458, -8.1498749105328177, 13.461490688312601, 25.457330889956381},
+    {20.671916208613766, 26.737314060455898, 6.4295844160627462, -18.186354992332959, -24.863331626471005, -9.1092814277736771, 14.958670367277191, 28.002059583643327},
+    {22.603407093131192, 29.093371423457583, 6.9829749741537466, -19.74994709926057, -27.057731194548396, -10.078140396647745, 16.448121160058683, 30.477939666529515},
+    {24.483303272892222, 31.344616854460046, 7.556491474380536, -21.238900187910598, -29.13127289610199, -11.002459455940519, 17.894410152875981, 32.847390707613997},
+    {26.278462085877692, 33.461112983673175, 8.1387240351163257, -22.668138689660637, -31.100880458854501, -11.837260109529836, 19.26376287308663, 35.077839686837187},
+    {27.958633966617551, 35.418998228434084, 8.7130456292694625, -24.039407131604658, -32.970612775975475, -12.555906924285818, 20.525809497122282, 37.143028548926964},
+    {29.497567731407841, 37.201141529397404, 9.2600421899987442, -25.336915009239608, -34.723415510063958, -13.151370259196105, 21.655049548169711, 39.02378254719315},
+    {30.873897314450108, 38.797456471963052, 9.7599708076018707, -26.530811985648846, -36.324244573874445, -13.631769212256925, 22.631866565733056, 40.708417615131594},
+    {32.071811127650008, 40.205627954724747, 10.194679708460679, -27.586602066366861, -37.732127627208556, -14.013782998118993, 23.442321963346306, 42.193532493015873},
+    {33.080673057938981, 41.436370879459901, 10.546530710314613, -28.474133653165627, -38.912247479579371, -14.316361865138319, 24.072178690575281, 43.489253881473473},
+    {33.98566522623122, 42.542974079214893, 10.8751877463572, -29.268685754444387, -39.943638163285343, -14.481821289109405, 24.523135187999305, 44.656864368218109},
+};
+
+constexpr int kOrder3Steps10Timesteps[] = {900, 810, 720, 630, 540, 450, 360, 270, 180, 90};
+constexpr double kOrder3Steps10Samples[][kSampleSize] = {
+    {5.4179177500275797, 6.3467892291995884, 1.4642376825247809, -4.4825432984471476, -6.2358435085028763, -2.344509303687965, 4.0303595771733276, 6.7738225233626519},
+    {7.296949193520688, 9.1581810557582752, 2.3634986093556578, -6.0060272321945094, -8.2932353017442697, -3.2849347219034808, 5.2225377414607781, 9.6432243718589383},
+    {9.5833695773444649, 12.237864477382494, 2.9562679448280167, -8.5450459386107873, -11.238057270375027, -3.934513321384407, 6.8954290878906601, 12.841200742160154},
+    {12.364964613798843, 15.640441855744529, 3.4873917900326936, -11.620713725657939, -15.156376372155677, -4.9029806248523311, 9.0606462272275365, 16.423138582313793},
+    {15.347546716260581, 19.174128923663613, 4.17824302845899, -14.318452940930269, -19.029984876117563, -6.2635458271199624, 11.386142815606698, 20.155641325610187},
+    {18.318118186902112, 22.60215987525892, 4.995993080791985, -16.600528018620125, -22.194033616702985, -7.7057684027908957, 13.694054536960019, 23.787711280805979},
+    {21.119401196261144, 25.780702518036158, 5.8375500942093419, -18.862832109066648, -25.056522519871429, -8.8782303356261885, 15.828090468607346, 27.164991415685826},
+    {23.539291716907165, 28.587472756733401, 6.5960878230102455, -21.126621590571741, -27.912099748598777, -9.6427944625597917, 17.581320732807704, 30.142212124425942},
+    {25.458596046915677, 30.932338339845515, 7.2862367086666424, -22.939745275844679, -30.216092675202283, -10.177965839923109, 18.849336531860072, 32.618395170484654},
+    {26.836298224825008, 32.797982352625503, 7.8033366901094716, -24.41546948463775, -32.043192565034353, -10.373640961215063, 19.606305951826517, 34.577062756132165},
+};
+
+constexpr int kOrder3Steps20Timesteps[] = {940, 893, 846, 799, 752, 705, 658, 611, 564, 517, 470, 423, 376, 329, 282, 235, 188, 141, 94, 47};
+constexpr double kOrder3Steps20Samples[][kSampleSize] = {
+    {4.6322148731200565, 5.1854971151724811, 1.0173807398930201, -3.9497742358009296, -5.2930575158138957, -1.7907023505003563, 3.5353464005035091, 5.5937766770199397},
+    {5.7520797102298973, 6.7378805775066466, 1.5717395137701802, -4.6641166704420476, -6.4970872777731152, -2.4886582916314235, 4.2620980246426097, 7.1976521102328004},
+    {6.9829763802638425, 8.4669357706178943, 2.1384096493434583, -5.5511164238929593, -7.8120881740725627, -3.1418882092787443, 5.0621678412567244, 8.9844216988875267},
+    {8.3504616723685761, 10.382174104033863, 2.7155758805503378, -6.6474281802134918, -9.326781860805351, -3.7832243861425483, 5.9684116937295855, 10.966118865845582},
+    {9.8297578616680958, 12.460304054490813, 3.2947045165845292, -7.9510252767361074, -11.052299167655201, -4.4195350876239159, 6.9642134272897227, 13.115922792157527},
+    {11.419275521467521, 14.672682780525539, 3.8497575595191313, -9.4737598898497541, -13.022522206716134, -5.0516197097521367, 8.0632116864988959, 15.408139870172342},
+    {13.123134358473472, 16.99576268712379, 4.3741854140663277, -11.179900874018053, -15.241721910540271, -5.7127518142796356, 9.2791696801871844, 17.821901466372928},
+    {14.927687292900952, 19.400597362786737, 4.8792869215229944, -12.98283218748173, -17.641120364628858, -6.440534214593864, 10.602390030853993, 20.327424332465927},
+    {16.80913264635727, 21.85114640598912, 5.3794600251704487, -14.792726618700074, -20.108476229879425, -7.2540371945972444, 12.01166089968037, 22.886837111988658},
+    {18.739951508720321, 24.308776755619775, 5.8879848162284727, -16.547940828505755, -22.541507844407686, -8.1490751589137016, 13.480683145910399, 25.459615193087277},
+    {20.688418249898216, 26.734524965719793, 6.4152129484908045, -18.219019164094444, -24.877709896642859, -9.0980066672544009, 14.977555588493916, 28.004400208965233},
+    {22.619923683542449, 29.09045577699893, 6.9651395467059487, -19.802110621500397, -27.093561047725768, -10.055336195248927, 16.466955910923865, 30.480488177138199},
+    {24.499630008518828, 31.341686563383938, 7.5338295679786214, -21.307782346642558, -29.190100519706167, -10.970511668956124, 17.913271730627891, 32.850212604366618},
+    {26.294287953534962, 33.458218691866492, 8.1102357681054258, -22.747190651794718, -31.175747681156487, -11.80152573448715, 19.28270566461801, 35.080932178338543},
+    {27.973493905666697, 35.416068844600069, 8.6780433829202721, -24.120426146864247, -33.050366683302926, -12.522824491841401, 20.544934598729519, 37.146257557654678},
+    {29.510772881925561, 37.197827858170584, 9.2179461688090036, -25.411387731715312, -34.796073646120355, -13.126594051346522, 21.674660586806436, 39.026726582167086},
+    {30.884419387865538, 38.792788939333086, 9.710023752656836, -26.590616728568591, -36.378857976213148, -13.619945609909934, 22.652865262896057, 40.710029883160104},
+    {32.077904147817065, 40.196844822764909, 10.135504454734917, -27.622859267112837, -37.757951835731653, -14.021026417351715, 23.467504430198943, 42.190967518401109},
+    {33.09218063082556, 41.428838885269961, 10.493584476087698, -28.526438623092247, -38.954972948620018, -14.311251422381792, 24.099130304103539, 43.488459728681306},
+    {33.997644056121388, 42.535394097751691, 10.819929512533253, -29.32128976018047, -39.986585190105444, -14.476521589919971, 24.551220249812324, 44.656064282857791},
+};
+
+constexpr int kOrder3Steps25Timesteps[] = {950, 912, 874, 836, 798, 760, 722, 684, 646, 608, 570, 532, 494, 456, 418, 380, 342, 304, 266, 228, 190, 152, 114, 76, 38};
+constexpr double kOrder3Steps25Samples[][kSampleSize] = {
+    {4.4434899297751587, 4.927560916848825, 0.92456925576345306, -3.8232467403226829, -5.0712660378563896, -1.6679049532339469, 3.4099560363224559, 5.3275894767635847},
+    {5.3763793072234956, 6.1771418968204488, 1.361381614109787, -4.4156012058072669, -6.0832832787654789, -2.2430347794277079, 4.0299788303368205, 6.6264097453580453},
+    {6.3904207730097156, 7.5603400588719811, 1.8249817279227765, -5.1001881145293444, -7.1603739076524686, -2.8147262748730526, 4.6971462300399436, 8.0624299369813581},
+    {7.4962653508502894, 9.0834186780845414, 2.3153046880487547, -5.8956079062250577, -8.3418757670157895, -3.3904725349674898, 5.4252273704131966, 9.6426018778933713},
+    {8.6788180899561898, 10.735942394658883, 2.8256577525193811, -6.809297371331593, -9.6309562213533741, -3.9620123016379813, 6.2032743145294269, 11.35431572101049},
+    {9.9397727835640595, 12.505160352180193, 3.3354157549920282, -7.871468859048643, -11.060698708417416, -4.5177980777043452, 7.0425775917531412, 13.187072862922186},
+    {11.284497400202055, 14.380892292064912, 3.8327353924872116, -9.0942928508052905, -12.664553540247224, -5.0674256358900784, 7.9564561847711568, 15.132713873189502},
+    {12.710271324311901, 16.350280504033755, 4.3147266983963579, -10.460573656558918, -14.449614609214892, -5.630182968272111, 8.947660142407484, 17.178594729686388},
+    {14.210147049043016, 18.396658813813595, 4.7817672391831136, -11.933764992668282, -16.39465743996201, -6.2253242858517623, 10.013891391913177, 19.307816109960488},
+    {15.774939064345135, 20.500938184681491, 5.2371756723835325, -13.466801345454487, -18.45402963158142, -6.8693375374889198, 11.149563309326805, 21.500914647403739},
+    {17.392232765272858, 22.642093138775596, 5.6870327461957375, -15.011610120462779, -20.567218662946434, -7.572264427557001, 12.344628527101367, 23.736090498842493},
+    {19.046672727961198, 24.797494547702126, 6.1383087600409079, -16.529387293257027, -22.674831627897635, -8.3340712926692522, 13.585232184180676, 25.98961299212143},
+    {20.720964887488215, 26.943693273391421, 6.5970765090192662, -17.996271694402189, -24.73231053073615, -9.1434169412020765, 14.854963001452553, 28.236761696423628},
+    {22.396640138485502, 29.057317746097905, 7.0673379146483812, -19.403187230184237, -26.714947641915693, -9.979117708259535, 16.135747361449383, 30.452790885819706},
+    {24.05473673008348, 31.115909016200384, 7.5502640753904169, -20.752017493533469, -28.615365301422457, -10.813890511614703, 17.408656543797377, 32.613814630663036},
+    {25.676483773339069, 33.098699677164191, 8.0438864298785031, -22.050046652797089, -30.436940192551731, -11.61940084395448, 18.654698940362987, 34.697644119794475},
+    {27.243897130248005, 34.98729617926093, 8.5432558165472869, -23.304175256927994, -32.185801366253109, -12.371093917952459, 19.855519191402042, 36.684519702329005},
+    {28.740263195710103, 36.766208775142019, 9.040949828085175, -24.516292091537046, -33.86367704024034, -13.051497001978252, 20.994005010144754, 38.557681198618283},
+    {30.150527738516537, 38.423203068819589, 9.5277934579977313, -25.68081792787477, -35.463576257605716, -13.651505888069867, 22.054824953426809, 40.303755581172545},
+    {31.461607456237214, 39.949471466156766, 9.9936844040336883, -26.784850044083921, -36.969389823964768, -14.169914475634767, 23.024898264483255, 41.912961150266852},
+    {32.662647186698635, 41.339650666465936, 10.428428313155969, -27.810586083497974, -38.359077102737274, -14.6117985979833, 23.893773037854142, 43.379154125966032},
+    {33.745248927892945, 42.591761289883713, 10.822479656916858, -28.738923382430784, -39.609658195068249, -14.986450637488167, 24.653845320641576, 44.699794795147511},
+    {34.703667615439265, 43.707224947337608, 11.167385037780392, -29.552504110783083, -40.70138399408372, -15.305697906502875, 25.300284566165939, 45.875993917729019},
+    {35.542266857660906, 44.702365032987842, 11.460778001044444, -30.255411744618396, -41.637608935598848, -15.56335959376543, 25.818000263910061, 46.924386676814215},
+    {36.339538084373075, 45.612954394593721, 11.746005895093701, -30.883931981938211, -42.451664715498183, -15.730119905485994, 26.210590007684718, 47.886758109395686},
+};
+
+// One scheduler configuration and its timesteps.
+struct Case {
+  int solver_order;
+  int steps;
+  const int *timesteps;
+  const double (*samples)[kSampleSize];
+};
+
+constexpr Case kCases[] = {
+    {2, 10, kOrder2Steps10Timesteps, kOrder2Steps10Samples},
+    {2, 20, kOrder2Steps20Timesteps, kOrder2Steps20Samples},
+    {3, 10, kOrder3Steps10Timesteps, kOrder3Steps10Samples},
+    {3, 20, kOrder3Steps20Timesteps, kOrder3Steps20Samples},
+    {3, 25, kOrder3Steps25Timesteps, kOrder3Steps25Samples},
+};
+
+}  // namespace unipc_reference
+
+#endif  // UNIPCREFERENCE_HPP
@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+"""Writes UniPCReference.hpp, the fixtures of unipc_reference_test.
+
+Runs diffusers' UniPCMultistepScheduler (bh2, predict_x0, epsilon, leading
+spacing, zero final sigma) on a fixed sample and a deterministic stand-in for
+the UNet, and records the timesteps and the sample after every step.
+
+Uses diffusers and torch in float64 when they are installed. Otherwise falls
+back to transcribe_unipc() below, a line-by-line transcription of diffusers'
+set_timesteps(), step(), multistep_uni_p_bh_update() and
+multistep_uni_c_bh_update() for this configuration in double precision.
+
+    python3 gen_unipc_reference.py [output]
+"""
+
+import math
+import os
+import sys
+
+NUM_TRAIN_TIMESTEPS = 1000
+BETA_START = 0.00085
+BETA_END = 0.012
+SAMPLE_SIZE = 8
+CASES = [(2, 10), (2, 20), (3, 10), (3, 20), (3, 25)]  # (solver_order, steps)
+
+
+def initial_sample():
+    return [0.3 * 14.0 * math.sin(i + 1.0) for i in range(SAMPLE_SIZE)]
+
+
+def model(sample, timestep):
+    return [math.sin(0.01 * timestep + 0.1 * x + i) for i, x in enumerate(sample)]
+
+
+def run_diffusers(order, steps):
+    import torch
+    from diffusers import UniPCMultistepScheduler
+
+    scheduler = UniPCMultistepScheduler(
+        num_train_timesteps=NUM_TRAIN_TIMESTEPS,
+        beta_start=BETA_START,
+        beta_end=BETA_END,
+        beta_schedule="scaled_linear",
+        solver_order=order,
+        prediction_type="epsilon",
+        predict_x0=True,
+        solver_type="bh2",
+        lower_order_final=True,
+        timestep_spacing="leading",
+        steps_offset=0,
+        final_sigmas_type="zero",
+    )
+    scheduler.set_timesteps(steps)
+    sample = torch.tensor(initial_sample(), dtype=torch.float64)
+    timesteps = [int(t) for t in scheduler.timesteps]
+    samples = []
+    for t in timesteps:
+        output = torch.tensor(model(sample.tolist(), t), dtype=torch.float64)
+        sample = scheduler.step(output, t, sample).prev_sample
+        samples.append(sample.tolist())
+    return timesteps, samples
+
+
+def solve(matrix, rhs):
+    """torch.linalg.solve for the small systems of the UniPC coefficients."""
+    n = len(rhs)
+    rows = [matrix[i][:] + [rhs[i]] for i in range(n)]
+    for col in range(n):
+        pivot = max(range(col, n), key=lambda r: abs(rows[r][col]))
+        rows[col], rows[pivot] = rows[pivot], rows[col]
+        for r in range(n):
+            if r != col:
+                f = rows[r][col] / rows[col][col]
+                rows[r] = [a - f * b for a, b in zip(rows[r], rows[col])]
+    return [rows[i][n] / rows[i][i] for i in range(n)]
+
+
+def transcribe_unipc(order, steps):
+    betas = [
+        (math.sqrt(BETA_START) + (math.sqrt(BETA_END) - math.sqrt(BETA_START))
+         * i / (NUM_TRAIN_TIMESTEPS - 1)) ** 2
+        for i in range(NUM_TRAIN_TIMESTEPS)
+    ]
+    alphas_cumprod = []
+    prod = 1.0
+    for beta in betas:
+        prod *= 1.0 - beta
+        alphas_cumprod.append(prod)
+
+    # set_timesteps(), "leading" spacing
+    step_ratio = NUM_TRAIN_TIMESTEPS // (steps + 1)
+    timesteps = [round(i * step_ratio) for i in range(steps + 1)][::-1][:-1]
+    sigmas = [math.sqrt((1 - alphas_cumprod[t]) / alphas_cumprod[t])
+              for t in timesteps] + [0.0]
+
+    def alpha_sigma(index):
+        alpha = 1.0 / math.sqrt(sigmas[index] ** 2 + 1.0)
+        return alpha, sigmas[index] * alpha
+
+    def lambda_(index):
+        alpha, sigma = alpha_sigma(index)
+        return math.log(alpha) - (math.log(sigma) if sigma > 0 else -math.inf)
+
+    def coefficients(rks, h, order):
+        hh = -h  # predict_x0
+        h_phi_1 = math.expm1(hh)
+        h_phi_k = h_phi_1 / hh - 1
+        factorial_i = 1
+        b_h = math.expm1(hh)  # bh2
+        R, b = [], []
+        for i in range(1, order + 1):
+            R.append([rk ** (i - 1) for rk in rks])
+            b.append(h_phi_k * factorial_i / b_h)
+            factorial_i *= i + 1
+            h_phi_k = h_phi_k / hh - 1 / factorial_i
+        return R, b, h_phi_1, b_h
+
+    def differences(model_outputs, m0, s0, h, order):
+        rks, d1s = [], []
+        for i in range(1, order):
+            rk = (lambda_(s0 - i) - lambda_(s0)) / h
+            mi = model_outputs[-(i + 1)]
+            rks.append(rk)
+            d1s.append([(a - b) / rk for a, b in zip(mi, m0)])
+        rks.append(1.0)
+        return rks, d1s
+
+    def uni_p_bh_update(model_outputs, sample, step_index, order):
+        m0 = model_outputs[-1]
+        alpha_t, sigma_t = alpha_sigma(step_index + 1)
+        _, sigma_s0 = alpha_sigma(step_index)
+        h = lambda_(step_index + 1) - lambda_(step_index)
+        rks, d1s = differences(model_outputs, m0, step_index, h, order)
+        R, b, h_phi_1, b_h = coefficients(rks, h, order)
+        if order == 2:
+            rhos_p = [0.5]
+        elif order > 2:
+            rhos_p = solve([row[:-1] for row in R[:-1]], b[:-1])
+        x_t = [sigma_t / sigma_s0 * x - alpha_t * h_phi_1 * m
+               for x, m in zip(sample, m0)]
+        for k, d1 in enumerate(d1s):
+            x_t = [x - alpha_t * b_h * rhos_p[k] * d for x, d in zip(x_t, d1)]
+        return x_t
+
+    def uni_c_bh_update(model_outputs, this_output, last_sample, step_index,
+                        order):
+        m0 = model_outputs[-1]
+        alpha_t, sigma_t = alpha_sigma(step_index)
+        _, sigma_s0 = alpha_sigma(step_index - 1)
+        h = lambda_(step_index) - lambda_(step_index - 1)
+        rks, d1s = differences(model_outputs, m0, step_index - 1, h, order)
+        R, b, h_phi_1, b_h = coefficients(rks, h, order)
+        rhos_c = [0.5] if order == 1 else solve(R, b)
+        x_t = [sigma_t / sigma_s0 * x - alpha_t * h_phi_1 * m
+               for x, m in zip(last_sample, m0)]
+        for k, d1 in enumerate(d1s):
+            x_t = [x - alpha_t * b_h * rhos_c[k] * d for x, d in zip(x_t, d1)]
+        return [x - alpha_t * b_h * rhos_c[-1] * (mt - m)
+                for x, mt, m in zip(x_t, this_output, m0)]
+
+    model_outputs = [None] * order
+    lower_order_nums = 0
+    last_sample = None
+    this_order = None
+    sample = initial_sample()
+    samples = []
+    for step_index, t in enumerate(timesteps):
+        # convert_model_output(), epsilon with predict_x0
+        alpha, sigma = alpha_sigma(step_index)
+        converted = [(x - sigma * e) / alpha
+                     for x, e in zip(sample, model(sample, t))]
+        if step_index > 0 and last_sample is not None:
+            sample = uni_c_bh_update(model_outputs, converted, last_sample,
+                                     step_index, this_order)
+        model_outputs = model_outputs[1:] + [converted]
+        this_order = min(order, len(timesteps) - step_index,
+                         lower_order_nums + 1)
+        last_sample = sample
+        sample = uni_p_bh_update(model_outputs, sample, step_index, this_order)
+        if lower_order_nums < order:
+            lower_order_nums += 1
+        samples.append(sample)
+    return timesteps, samples
+
+
+def main():
+    output = sys.argv[1] if len(sys.argv) > 1 else os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "UniPCReference.hpp")
+    try:
+        import diffusers  # noqa: F401
+        import torch  # noqa: F401
+        run, source = run_diffusers, "diffusers " + diffusers.__version__
+    except ImportError:
+        run, source = transcribe_unipc, "the diffusers transcription"
+
+    lines = [
+        "// Generated by gen_unipc_reference.py from " + source + ".",
+        "// Do not edit.",
+        "#ifndef UNIPCREFERENCE_HPP",
+        "#define UNIPCREFERENCE_HPP",
+        "",
+        "namespace unipc_reference {",
+        "",
+        "// The samples after every step, starting from",
+        "// x_i = 0.3 * 14 * sin(i + 1), with eps_i = sin(0.01 t + 0.1 x_i + i)",
+        "// as the model output.",
+        "constexpr int kSampleSize = %d;" % SAMPLE_SIZE,
+        "",
+    ]
+    cases = []
+    for order, steps in CASES:
+        timesteps, samples = run(order, steps)
+        name = "Order%dSteps%d" % (order, steps)
+        lines.append("constexpr int k%sTimesteps[] = {%s};" % (
+            name, ", ".join(str(t) for t in timesteps)))
+        lines.append("constexpr double k%sSamples[][kSampleSize] = {" % name)
+        for sample in samples:
+            lines.append("    {%s}," % ", ".join("%.17g" % x for x in sample))
+        lines.append("};")
+        lines.append("")
+        cases.append("    {%d, %d, k%sTimesteps, k%sSamples}," % (
+            order, steps, name, name))
+    lines += [
+        "// One scheduler configuration and its timesteps.",
+        "struct Case {",
+        "  int solver_order;",
+        "  int steps;",
+        "  const int *timesteps;",
+        "  const double (*samples)[kSampleSize];",
+        "};",
+        "",
+        "constexpr Case kCases[] = {",
+    ] + cases + [
+        "};",
+        "",
+        "}  // namespace unipc_reference",
+        "",
+        "#endif  // UNIPCREFERENCE_HPP",
+    ]
+    with open(output, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
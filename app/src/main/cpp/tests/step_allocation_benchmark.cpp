@@ -0,0 +1,118 @@
+// Times the scheduler half of a denoising step on the pipeline's
+// preallocated, 64-byte aligned buffers and fails if any step touches the
+// heap. The UNet half (QnnModel::executeUnetGraphs) needs the device; it
+// writes into the same GenerationContext buffers without allocating.
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "DPMSolverMultistepScheduler.hpp"
+#include "LCMScheduler.hpp"
+#include "UniPCMultistepScheduler.hpp"
+
+namespace {
+std::atomic<long> g_allocations{0};
+
+void *counted_malloc(size_t size) {
+  g_allocations++;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+}  // namespace
+
+// Every form allocates with malloc and frees with free, so the pairs match.
+void *operator new(size_t size) { return counted_malloc(size); }
+void *operator new[](size_t size) { return counted_malloc(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+using AlignedFloats = std::vector<float, xsimd::aligned_allocator<float, 64>>;
+
+// Runs one image worth of steps the way GenerationTask::denoiseStep() does
+// and returns the number of allocations made inside the step calls.
+long run(const std::string &name, std::unique_ptr<Scheduler> scheduler,
+         int steps, bool use_cfg) {
+  const int sample_size = 64;
+  const size_t latent_size = 4 * sample_size * sample_size;
+  const int batch = use_cfg ? 2 : 1;
+
+  scheduler->set_timesteps(steps);
+  scheduler->reserve(latent_size);
+  xt::xarray<float> timesteps = scheduler->get_timesteps();
+
+  AlignedFloats latents(latent_size);
+  AlignedFloats unet_input(batch * latent_size);
+  AlignedFloats unet_output(batch * latent_size);
+  for (size_t i = 0; i < latent_size; i++) {
+    latents[i] = std::sin(0.37f * i);
+  }
+  float *unet_inputs[] = {unet_input.data(), unet_input.data() + latent_size};
+
+  long allocations = 0;
+  double total_us = 0;
+  for (size_t s = 0; s < timesteps.size(); s++) {
+    // Stand-in for the UNet: any deterministic noise prediction will do.
+    for (size_t i = 0; i < unet_output.size(); i++) {
+      unet_output[i] = 0.5f * unet_input[i % latent_size] + 0.01f * (i % 7);
+    }
+    const float *noise_pred_uncond = unet_output.data();
+    const float *noise_pred_text =
+        use_cfg ? noise_pred_uncond + latent_size : nullptr;
+
+    long before = g_allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    scheduler->step(noise_pred_uncond, noise_pred_text, 7.5f,
+                    int(timesteps(s)), latents.data(), latent_size,
+                    unet_inputs, batch);
+    auto end = std::chrono::steady_clock::now();
+    allocations += g_allocations.load() - before;
+    total_us += std::chrono::duration<double, std::micro>(end - start).count();
+  }
+
+  std::printf("%-10s cfg=%d steps=%2d: %8.1f us/step, %ld allocations\n",
+              name.c_str(), use_cfg, steps, total_us / timesteps.size(),
+              allocations);
+  return allocations;
+}
+
+}  // namespace
+
+int main() {
+  long allocations = 0;
+  for (bool use_cfg : {true, false}) {
+    allocations += run("dpm_solver",
+                       std::make_unique<DPMSolverMultistepScheduler>(
+                           1000, 0.00085f, 0.012f, "scaled_linear", 2,
+                           "epsilon", "leading"),
+                       20, use_cfg);
+    allocations += run("unipc",
+                       std::make_unique<UniPCMultistepScheduler>(
+                           1000, 0.00085f, 0.012f, "scaled_linear", 2,
+                           "epsilon", "leading"),
+                       20, use_cfg);
+    allocations += run("lcm",
+                       std::make_unique<LCMScheduler>(
+                           1000, 0.00085f, 0.012f, "scaled_linear", 50,
+                           "epsilon"),
+                       4, use_cfg);
+  }
+  if (allocations != 0) {
+    std::printf("FAIL: %ld heap allocations inside scheduler steps\n",
+                allocations);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}